@@ -0,0 +1,195 @@
+//
+//  align.h
+//  MakeHDR
+//
+//  Created by Vahan Sosoyan 2024.
+//
+
+#ifndef align_h
+#define align_h
+
+#include "resources.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+
+namespace fx
+{
+    inline int popcount(uint64_t bits)
+    {
+#if defined(_MSC_VER)
+        return (int)__popcnt64(bits);
+#else
+        return __builtin_popcountll(bits);
+#endif
+    }
+
+    /// 1-bit image packed into 64-bit words, each row padded to a whole word.
+    struct bitmap
+    {
+    public:
+        void resize(const int w, const int h)
+        {
+            width = w;
+            height = h;
+            words = (w + 63) / 64;
+            bits.assign((size_t)words * h, 0);
+        }
+
+        /// 64 bits starting at column x of row y, zero outside the bitmap.
+        uint64_t fetch(const int x, const int y) const
+        {
+            if (y < 0 || y >= height || x <= -64 || x >= width)
+                return 0;
+
+            const uint64_t* row = bits.data() + (size_t)y * words;
+            const int word = x >= 0 ? x / 64 : -1;
+            const int shift = x - word * 64;
+
+            const uint64_t low = word >= 0 ? row[word] : 0;
+            const uint64_t high = word + 1 < words ? row[word + 1] : 0;
+
+            return shift == 0 ? low : (low >> shift) | (high << (64 - shift));
+        }
+
+        int width = 0;
+        int height = 0;
+        int words = 0;
+        std::vector<uint64_t> bits;
+    };
+
+    /// One level of a median threshold bitmap pyramid (Ward 2003): pixels above the
+    /// median, and a mask excluding pixels too close to the median to be reliable.
+    struct mtb_level
+    {
+        bitmap threshold;
+        bitmap exclusion;
+    };
+
+    /// Builds the pyramid of an 8-bit gray image, finest level first. The image is downsampled
+    /// in place, so callers done with it should move it in.
+    inline std::vector<mtb_level> mtb_pyramid(std::vector<uint8_t> gray, int width, int height, const int levels, const int noise = 4)
+    {
+        std::vector<mtb_level> pyramid(levels);
+
+        for (int l = 0; l < levels; ++l)
+        {
+            int histogram[256] = { 0 };
+            for (const uint8_t value : gray)
+                ++histogram[value];
+
+            int median = 0;
+            for (int count = 0; median < 255 && count + histogram[median] < (int)gray.size() / 2; ++median)
+                count += histogram[median];
+
+            mtb_level& level = pyramid[l];
+            level.threshold.resize(width, height);
+            level.exclusion.resize(width, height);
+
+            for (int y = 0; y < height; ++y)
+            {
+                const uint8_t* row = gray.data() + (size_t)y * width;
+
+                for (int w = 0; w < level.threshold.words; ++w)
+                {
+                    uint64_t threshold = 0;
+                    uint64_t exclusion = 0;
+
+                    for (int x = w * 64, bit = 0; x < std::min(width, w * 64 + 64); ++x, ++bit)
+                    {
+                        threshold |= (uint64_t)(row[x] > median) << bit;
+                        exclusion |= (uint64_t)(std::abs(row[x] - median) > noise) << bit;
+                    }
+
+                    level.threshold.bits[(size_t)y * level.threshold.words + w] = threshold;
+                    level.exclusion.bits[(size_t)y * level.exclusion.words + w] = exclusion;
+                }
+            }
+
+            if (l + 1 == levels)
+                break;
+
+            const int half_width = std::max(1, width / 2);
+            const int half_height = std::max(1, height / 2);
+            std::vector<uint8_t> half((size_t)half_width * half_height);
+
+            for (int y = 0; y < half_height; ++y)
+            {
+                for (int x = 0; x < half_width; ++x)
+                {
+                    const int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+                    const int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+
+                    half[(size_t)y * half_width + x] = (uint8_t)((gray[(size_t)y0 * width + x0] + gray[(size_t)y0 * width + x1] +
+                                                                  gray[(size_t)y1 * width + x0] + gray[(size_t)y1 * width + x1] + 2) / 4);
+                }
+            }
+
+            gray.swap(half);
+            width = half_width;
+            height = half_height;
+        }
+
+        return pyramid;
+    }
+
+    /// Number of reliable pixels that disagree when src is shifted by (dx, dy) onto ref.
+    inline long long mtb_difference(const mtb_level& ref, const mtb_level& src, const int dx, const int dy)
+    {
+        long long difference = 0;
+
+        for (int y = 0; y < ref.threshold.height; ++y)
+        {
+            const uint64_t* ref_threshold = ref.threshold.bits.data() + (size_t)y * ref.threshold.words;
+            const uint64_t* ref_exclusion = ref.exclusion.bits.data() + (size_t)y * ref.exclusion.words;
+
+            for (int w = 0; w < ref.threshold.words; ++w)
+            {
+                const int x = w * 64 + dx;
+                const uint64_t mask = ref_exclusion[w] & src.exclusion.fetch(x, y + dy);
+
+                if (mask != 0)
+                    difference += popcount((ref_threshold[w] ^ src.threshold.fetch(x, y + dy)) & mask);
+            }
+        }
+
+        return difference;
+    }
+
+    /// Integer translation of src relative to ref, searched coarse to fine with
+    /// a 3x3 neighbourhood per level. Source pixel (x + dx, y + dy) matches ref pixel (x, y).
+    inline point mtb_offset(const std::vector<mtb_level>& ref, const std::vector<mtb_level>& src)
+    {
+        point offset(0, 0);
+
+        for (int l = (int)ref.size() - 1; l >= 0; --l)
+        {
+            offset = point(offset.x * 2, offset.y * 2);
+
+            point best = offset;
+            long long best_difference = -1;
+
+            for (int j = -1; j <= 1; ++j)
+            {
+                for (int i = -1; i <= 1; ++i)
+                {
+                    const long long difference = mtb_difference(ref[l], src[l], offset.x + i, offset.y + j);
+
+                    if (best_difference < 0 || difference < best_difference)
+                    {
+                        best_difference = difference;
+                        best = point(offset.x + i, offset.y + j);
+                    }
+                }
+            }
+
+            offset = best;
+        }
+
+        return offset;
+    }
+}
+
+#endif
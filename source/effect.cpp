@@ -4,17 +4,49 @@
 template <class ptype>
 void Effect<ptype>::changedParam(const OFX::InstanceChangedArgs& args, const std::string& param_name)
 {
+    /// Exposure times are part of the Debevec system, a re-merge keeps the curve only when
+    /// it does not depend on them, loaded from a profile or linear. The middle exposure may
+    /// move, so the alignment is redone either way.
+    const bool keep_curve = bracket_update(args.time) == 1 &&
+                            slot_index(param_name) >= 0 &&
+                            (!calibrate(args.time) || use_profile(args.time));
+
+    if (keep_curve)
+        invalidate_offsets();
+
     if (param_name != "exposure" &&
         param_name != "gamma" &&
         param_name != "highlights" &&
+        param_name != "tone_operator" &&
+        param_name != "base_range" &&
+        param_name != "detail" &&
         param_name != "use_middle_gray" &&
         param_name != "middle_gray" &&
         param_name != "show_samples" &&
-        param_name != "log_level")
+        param_name != "mode" &&
+        param_name != "fusion_contrast" &&
+        param_name != "fusion_saturation" &&
+        param_name != "fusion_exposedness" &&
+        param_name != "deghost" &&
+        param_name != "deghost_threshold" &&
+        param_name != "bracket_update" &&
+        param_name != "calib_serial" &&
+        param_name != "profile_camera" &&
+        param_name != "export_profile" &&
+        param_name != "log_level" &&
+        !keep_curve)
     {
         _regen_calib = true;
+        invalidate_offsets();
+        cancel_calibration();
     }
 
+    if (param_name == "use_profile" || param_name == "profile_file")
+        _profile_path.clear();
+
+    if (param_name == "export_profile")
+        export_profile(args.time);
+
     if (param_name == "use_middle_gray")
     {
         bool use;
@@ -23,6 +55,31 @@ void Effect<ptype>::changedParam(const OFX::InstanceChangedArgs& args, const std
     }
 }
 
+template <class ptype>
+void Effect<ptype>::changedClip(const OFX::InstanceChangedArgs& /*args*/, const std::string& clip_name)
+{
+    invalidate_offsets();
+
+    const int slot = slot_index(clip_name);
+
+    if (slot >= 0)
+    {
+        std::lock_guard<std::mutex> lock(_changed_slots_mutex);
+        _changed_slots[slot] = true;
+    }
+}
+
+/// Source slots whose clip changed since the last call, for the incremental merge.
+template <class ptype>
+std::vector<bool> Effect<ptype>::take_changed_slots()
+{
+    std::lock_guard<std::mutex> lock(_changed_slots_mutex);
+
+    std::vector<bool> changed(SRC_MAX, false);
+    changed.swap(_changed_slots);
+    return changed;
+}
+
 template <class ptype>
 void Effect<ptype>::render(const OFX::RenderArguments& args)
 {
@@ -85,7 +142,7 @@ void Effect<ptype>::process(Processor<ptype>& processor, const OFX::RenderArgume
                                 dst_image->getBounds().y1 == src_image->getBounds().y1 &&
                                 dst_image->getBounds().y2 == src_image->getBounds().y2)
                             {
-                                processor.add_source(src_image);
+                                processor.add_source(i, src_image);
                                 processor.add_exp_time(exp_time);
                             }
                             else
@@ -112,6 +169,7 @@ void Effect<ptype>::process(Processor<ptype>& processor, const OFX::RenderArgume
         processor.setDstImg(dst_image.get());
         processor.setRenderWindow(args.renderWindow);
         processor.set_resolution(args.renderWindow);
+        processor.set_bounds(dst_image->getBounds());
         processor.set_parameters(args.time);
         processor.set_linear_response();
         processor.set_response();
@@ -154,6 +212,167 @@ void Effect<ptype>::set_log_level(int level)
     }
 }
 
+template<class ptype>
+void Effect<ptype>::start_calibration(int depth, const std::function<bool(std::vector<double>&, const fx::cancel_token&)>& solve)
+{
+    if (_calib_thread.joinable())
+        _calib_thread.join();
+
+    std::shared_ptr<fx::cancel_token> cancel = std::make_shared<fx::cancel_token>();
+
+    {
+        std::lock_guard<std::mutex> lock(_calib_mutex);
+        _calib_cancel = cancel;
+    }
+
+    _calib_running = true;
+    _calib_thread = std::thread([this, depth, solve, cancel]()
+    {
+        std::vector<double> response;
+
+        const bool solved = solve(response, *cancel);
+
+        if (solved)
+        {
+            std::lock_guard<std::mutex> lock(_calib_mutex);
+            _calib_result.swap(response);
+            _calib_result_depth = depth;
+        }
+
+        _calib_running = false;
+
+        if (!solved || cancel->cancelled() || _closing)
+            return;
+
+        /// Hosts re-render on a param change, bumping the hidden serial is how the finished
+        /// curve reaches the viewer without user interaction. Only this thread writes it, and
+        /// not once the instance is closing, as the destructor joins this thread.
+        try
+        {
+            _calib_serial->setValue(_calib_serial->getValue() + 1);
+        }
+        catch (...)
+        {
+            spdlog::debug("[{}] could not request a re-render after calibration", fx::label);
+        }
+    });
+}
+
+template<class ptype>
+bool Effect<ptype>::cached_offsets(const double& time, std::vector<fx::point>& offsets)
+{
+    std::lock_guard<std::mutex> lock(_offsets_mutex);
+
+    if (!_offsets_valid || _offsets_time != time)
+        return false;
+
+    offsets = _offsets;
+    return true;
+}
+
+template<class ptype>
+void Effect<ptype>::cache_offsets(const double& time, const std::vector<fx::point>& offsets)
+{
+    std::lock_guard<std::mutex> lock(_offsets_mutex);
+
+    _offsets = offsets;
+    _offsets_time = time;
+    _offsets_valid = true;
+}
+
+template<class ptype>
+void Effect<ptype>::invalidate_offsets()
+{
+    std::lock_guard<std::mutex> lock(_offsets_mutex);
+    _offsets_valid = false;
+}
+
+template<class ptype>
+void Effect<ptype>::cancel_calibration()
+{
+    std::lock_guard<std::mutex> lock(_calib_mutex);
+
+    if (_calib_cancel)
+        _calib_cancel->cancel();
+}
+
+template<class ptype>
+bool Effect<ptype>::adopt_calibration()
+{
+    std::lock_guard<std::mutex> lock(_calib_mutex);
+
+    if (_calib_result.empty())
+        return false;
+
+    _response.swap(_calib_result);
+    _calib_result.clear();
+    _calibrated_depth = _calib_result_depth;
+
+    return true;
+}
+
+template<class ptype>
+bool Effect<ptype>::apply_profile(const std::string& path, int depth)
+{
+    if (path != _profile_path)
+    {
+        _profile_path = path;
+        _profile = fx::profile();
+
+        if (_profile.load(path))
+            spdlog::info("[{}] profile {} loaded, camera '{}', {} bins", fx::label, path, _profile.camera, _profile.depth);
+        else
+        {
+            spdlog::error("[{}] could not load profile '{}'!", fx::label, path);
+            _profile.depth = 0;
+        }
+    }
+
+    if (_profile.depth < 2)
+        return false;
+
+    if (!_regen_calib && calibrated(depth))
+        return true;
+
+    _response.resize(depth * CMP_MAX);
+    _profile.resample(depth, _response.data());
+    _calibrated_depth = depth;
+    _regen_calib = false;
+
+    return true;
+}
+
+template<class ptype>
+void Effect<ptype>::export_profile(const double& time)
+{
+    const std::string path = profile_file(time);
+    const int depth = input_depth(time);
+
+    if (path.empty())
+    {
+        sendMessage(OFX::Message::eMessageError, "", "Set the profile file before exporting.");
+        return;
+    }
+    if (!calibrated(depth) || (int)_response.size() < depth * CMP_MAX)
+    {
+        sendMessage(OFX::Message::eMessageError, "", "No solved response to export, render a frame with calibration on first.");
+        return;
+    }
+
+    fx::profile profile;
+    _profile_camera->getValueAtTime(time, profile.camera);
+    profile.depth = depth;
+    profile.solver = solver_type(time);
+    profile.samples = samples(time);
+    profile.smoothness = smoothness(time);
+    profile.response.assign(_response.begin(), _response.begin() + depth * CMP_MAX);
+
+    if (profile.save(path))
+        spdlog::info("[{}] profile saved to {}", fx::label, path);
+    else
+        sendMessage(OFX::Message::eMessageError, "", "Could not write profile " + path);
+}
+
 template<class ptype>
 void Effect<ptype>::set_input_weights(int size)
 {
@@ -191,29 +410,101 @@ void EffectPluginFactory::describeInContext(OFX::ImageEffectDescriptor& desc, OF
     // Setup parameters
     OFX::GroupParamDescriptor* exposure_times_group = desc.defineGroupParam("exposure_times");
     OFX::GroupParamDescriptor* tone_mapping_group = desc.defineGroupParam("tone_mapping");
+    OFX::GroupParamDescriptor* fusion_group = desc.defineGroupParam("fusion");
+    OFX::GroupParamDescriptor* profile_group = desc.defineGroupParam("profile");
     OFX::GroupParamDescriptor* advanced_group = desc.defineGroupParam("advanced");
 
+    OFX::ChoiceParamDescriptor* mode_param = desc.defineChoiceParam("mode");
+    OFX::DoubleParamDescriptor* fusion_contrast_param = desc.defineDoubleParam("fusion_contrast");
+    OFX::DoubleParamDescriptor* fusion_saturation_param = desc.defineDoubleParam("fusion_saturation");
+    OFX::DoubleParamDescriptor* fusion_exposedness_param = desc.defineDoubleParam("fusion_exposedness");
     OFX::BooleanParamDescriptor* calibrate_param = desc.defineBooleanParam("calibrate");
+    OFX::BooleanParamDescriptor* async_calibration_param = desc.defineBooleanParam("async_calibration");
+    OFX::IntParamDescriptor* calib_serial_param = desc.defineIntParam("calib_serial");
+    OFX::BooleanParamDescriptor* use_profile_param = desc.defineBooleanParam("use_profile");
+    OFX::StringParamDescriptor* profile_file_param = desc.defineStringParam("profile_file");
+    OFX::StringParamDescriptor* profile_camera_param = desc.defineStringParam("profile_camera");
+    OFX::PushButtonParamDescriptor* export_profile_param = desc.definePushButtonParam("export_profile");
     OFX::BooleanParamDescriptor* use_middle_gray_param = desc.defineBooleanParam("use_middle_gray");
     OFX::DoubleParamDescriptor* exposure_param = desc.defineDoubleParam("exposure");
     OFX::DoubleParamDescriptor* gamma_param = desc.defineDoubleParam("gamma");
     OFX::DoubleParamDescriptor* highlights_param = desc.defineDoubleParam("highlights");
+    OFX::ChoiceParamDescriptor* tone_operator_param = desc.defineChoiceParam("tone_operator");
+    OFX::DoubleParamDescriptor* base_range_param = desc.defineDoubleParam("base_range");
+    OFX::DoubleParamDescriptor* detail_param = desc.defineDoubleParam("detail");
     OFX::RGBAParamDescriptor* middle_gray_param = desc.defineRGBAParam("middle_gray");
     OFX::BooleanParamDescriptor* show_samples_param = desc.defineBooleanParam("show_samples");
     OFX::IntParamDescriptor* samples_param = desc.defineIntParam("samples");
+    OFX::BooleanParamDescriptor* align_param = desc.defineBooleanParam("align");
+    OFX::IntParamDescriptor* align_shift_param = desc.defineIntParam("align_shift");
+    OFX::BooleanParamDescriptor* deghost_param = desc.defineBooleanParam("deghost");
+    OFX::DoubleParamDescriptor* deghost_threshold_param = desc.defineDoubleParam("deghost_threshold");
+    OFX::BooleanParamDescriptor* pack_sources_param = desc.defineBooleanParam("pack_sources");
     OFX::ChoiceParamDescriptor* solver_param = desc.defineChoiceParam("solver");
     OFX::DoubleParamDescriptor* smoothness_param = desc.defineDoubleParam("smoothness");
+    OFX::IntParamDescriptor* calibration_budget_param = desc.defineIntParam("calibration_budget");
+    OFX::DoubleParamDescriptor* target_coverage_param = desc.defineDoubleParam("target_coverage");
+    OFX::ChoiceParamDescriptor* share_calibration_param = desc.defineChoiceParam("share_calibration");
+    OFX::ChoiceParamDescriptor* bracket_update_param = desc.defineChoiceParam("bracket_update");
+    OFX::IntParamDescriptor* memory_budget_param = desc.defineIntParam("memory_budget");
     OFX::ChoiceParamDescriptor* input_depth_param = desc.defineChoiceParam("input_depth");
     OFX::ChoiceParamDescriptor* log_level_param = desc.defineChoiceParam("log_level");
 
     exposure_times_group->setLabel("exposure times");
     tone_mapping_group->setLabel("tone mapping");
+    fusion_group->setLabel("exposure fusion");
+
+    mode_param->appendOption("hdr merge");
+    mode_param->appendOption("exposure fusion");
+    mode_param->setDefault(0);
+    mode_param->setLabel("mode");
+    mode_param->setHint("hdr merge calibrates the camera response and merges the sources into linear radiance, then tone maps it. exposure fusion blends the sources directly into a display ready image, without calibration or tone mapping.");
+
+    fusion_contrast_param->setDefault(1.0);
+    fusion_contrast_param->setRange(0, 10);
+    fusion_contrast_param->setDisplayRange(0, 2);
+    fusion_contrast_param->setLabel("contrast");
+    fusion_contrast_param->setHint("Exponent of the local contrast weight. Higher values favour detailed regions.");
+    fusion_contrast_param->setParent(*fusion_group);
+
+    fusion_saturation_param->setDefault(1.0);
+    fusion_saturation_param->setRange(0, 10);
+    fusion_saturation_param->setDisplayRange(0, 2);
+    fusion_saturation_param->setLabel("saturation");
+    fusion_saturation_param->setHint("Exponent of the saturation weight. Higher values favour colourful regions.");
+    fusion_saturation_param->setParent(*fusion_group);
+
+    fusion_exposedness_param->setDefault(1.0);
+    fusion_exposedness_param->setRange(0, 10);
+    fusion_exposedness_param->setDisplayRange(0, 2);
+    fusion_exposedness_param->setLabel("well-exposedness");
+    fusion_exposedness_param->setHint("Exponent of the well-exposedness weight. Higher values favour pixels close to mid-gray.");
+    fusion_exposedness_param->setParent(*fusion_group);
 
     calibrate_param->setDefault(true);
     calibrate_param->setLabel("calibrate response");
     calibrate_param->setHint("When on, the camera response curve is estimated from the source images using the selected solver. When off, a linear response is assumed.");
     calibrate_param->setParent(*exposure_times_group);
 
+    use_profile_param->setDefault(false);
+    use_profile_param->setLabel("use profile");
+    use_profile_param->setHint("Load the response curves from the profile file instead of solving them. Profiles of another bit depth are resampled to the input depth.");
+    use_profile_param->setParent(*profile_group);
+
+    profile_file_param->setStringType(OFX::eStringTypeFilePath);
+    profile_file_param->setFilePathExists(false);
+    profile_file_param->setLabel("profile file");
+    profile_file_param->setHint("Camera response profile to load, or to write with export.");
+    profile_file_param->setParent(*profile_group);
+
+    profile_camera_param->setLabel("camera");
+    profile_camera_param->setHint("Camera identifier stored in exported profiles, e.g. body model and serial.");
+    profile_camera_param->setParent(*profile_group);
+
+    export_profile_param->setLabel("export profile");
+    export_profile_param->setHint("Write the currently solved response curves and solver settings to the profile file.");
+    export_profile_param->setParent(*profile_group);
+
     use_middle_gray_param->setDefault(false);
     use_middle_gray_param->setLabel("target middle gray");
     use_middle_gray_param->setHint("Enable middle gray normalisation. When on, the merged image is scaled so its geometric mean luminance matches the target middle gray value.");
@@ -234,6 +525,27 @@ void EffectPluginFactory::describeInContext(OFX::ImageEffectDescriptor& desc, OF
     highlights_param->setHint("Blends between fully tone-mapped (0) and linear (1) output. Lower values compress highlights more aggressively.");
     highlights_param->setParent(*tone_mapping_group);
 
+    tone_operator_param->appendOption("global");
+    tone_operator_param->appendOption("local");
+    tone_operator_param->setDefault(0);
+    tone_operator_param->setLabel("operator");
+    tone_operator_param->setHint("global applies the Reinhard curve to every pixel alike. local compresses a bilateral filtered base layer and keeps the detail layer, preserving contrast in interiors next to bright windows.");
+    tone_operator_param->setParent(*tone_mapping_group);
+
+    base_range_param->setDefault(5.0);
+    base_range_param->setRange(0.5, 20);
+    base_range_param->setDisplayRange(1, 12);
+    base_range_param->setLabel("base range");
+    base_range_param->setHint("Local operator: dynamic range in stops the base layer is compressed to.");
+    base_range_param->setParent(*tone_mapping_group);
+
+    detail_param->setDefault(1.0);
+    detail_param->setRange(0, 4);
+    detail_param->setDisplayRange(0, 2);
+    detail_param->setLabel("detail");
+    detail_param->setHint("Local operator: gain of the detail layer. Above 1 exaggerates local contrast.");
+    detail_param->setParent(*tone_mapping_group);
+
     middle_gray_param->setDefault(0.18, 0.18, 0.18, 1.0);
     middle_gray_param->setLabel("middle gray");
     middle_gray_param->setHint("Pick the reference gray patch from the scene (e.g. a color checker). The plugin scales the merged image so the luminance of the picked color matches the scene average.");
@@ -245,6 +557,45 @@ void EffectPluginFactory::describeInContext(OFX::ImageEffectDescriptor& desc, OF
     show_samples_param->setLabel("show samples");
     show_samples_param->setHint("Overlay the calibration sample positions on the output image as bright green pixels.");
 
+    async_calibration_param->setDefault(false);
+    async_calibration_param->setParent(*advanced_group);
+    async_calibration_param->setLabel("background calibration");
+    async_calibration_param->setHint("Solve the response curve on a background thread. Renders use the previous curve, or a linear response, until the new curve is ready, then request a re-render to pick it up.");
+
+    calib_serial_param->setDefault(0);
+    calib_serial_param->setIsSecret(true);
+    calib_serial_param->setIsPersistant(false);
+    calib_serial_param->setAnimates(false);
+
+    align_param->setDefault(false);
+    align_param->setParent(*advanced_group);
+    align_param->setLabel("align sources");
+    align_param->setHint("Find the translation of every source against the middle exposure with median threshold bitmaps, and apply it while merging. For handheld brackets.");
+
+    align_shift_param->setDefault(32);
+    align_shift_param->setRange(1, 512);
+    align_shift_param->setDisplayRange(1, 128);
+    align_shift_param->setParent(*advanced_group);
+    align_shift_param->setLabel("max shift");
+    align_shift_param->setHint("Largest translation in pixels searched for by source alignment.");
+
+    deghost_param->setDefault(false);
+    deghost_param->setParent(*advanced_group);
+    deghost_param->setLabel("deghost");
+    deghost_param->setHint("Compare the radiance of every source with the middle exposure in small tiles while merging, and lower the weight of sources that disagree, such as people or foliage moving between brackets.");
+
+    deghost_threshold_param->setDefault(0.5);
+    deghost_threshold_param->setRange(0.05, 4);
+    deghost_threshold_param->setDisplayRange(0.1, 2);
+    deghost_threshold_param->setParent(*advanced_group);
+    deghost_threshold_param->setLabel("ghost threshold");
+    deghost_threshold_param->setHint("Mean radiance difference in stops from the middle exposure at which a source keeps half its weight in a tile. Lower values reject motion more aggressively.");
+
+    pack_sources_param->setDefault(false);
+    pack_sources_param->setParent(*advanced_group);
+    pack_sources_param->setLabel("pack sources");
+    pack_sources_param->setHint("Convert all sources once into 16 bit bin indices packed by pixel before calibrating and merging, so the merge reads one contiguous stream instead of a float image per source. Costs 6 bytes per pixel and source, and source values above 1 are clipped in the merge fallback.");
+
     input_depth_param->appendOption("8 bit");
     input_depth_param->appendOption("10 bit");
     input_depth_param->appendOption("12 bit");
@@ -259,10 +610,12 @@ void EffectPluginFactory::describeInContext(OFX::ImageEffectDescriptor& desc, OF
     samples_param->setParent(*advanced_group);
     solver_param->appendOption("debevec");
     solver_param->appendOption("robertson");
+    solver_param->appendOption("debevec iterative");
+    solver_param->appendOption("debevec mixed precision");
     solver_param->setDefault(0);
     solver_param->setParent(*advanced_group);
     solver_param->setLabel("solver");
-    solver_param->setHint("Response curve estimation algorithm. Debevec solves a linear system (fast, sparse samples). Robertson uses an iterative expectation-maximisation approach.");
+    solver_param->setHint("Response curve estimation algorithm. Debevec solves a linear system (fast, sparse samples). Robertson uses an iterative expectation-maximisation approach. Debevec iterative solves the same system with preconditioned conjugate gradients, starting from the current curve, so small changes re-solve in a few iterations. Debevec mixed precision factors the system in single precision and refines the result to double accuracy, using half the memory, and falls back to the double solve when refinement stalls, or to debevec iterative when the memory budget rules the double solve out.");
     smoothness_param->setDefault(50);
     smoothness_param->setRange(1, 100);
     smoothness_param->setDisplayRange(1, 100);
@@ -270,6 +623,42 @@ void EffectPluginFactory::describeInContext(OFX::ImageEffectDescriptor& desc, OF
     smoothness_param->setLabel("smoothness / iterations");
     smoothness_param->setParent(*advanced_group);
 
+    calibration_budget_param->setDefault(0);
+    calibration_budget_param->setRange(0, 600000);
+    calibration_budget_param->setDisplayRange(0, 10000);
+    calibration_budget_param->setLabel("calibration budget");
+    calibration_budget_param->setHint("Time budget for calibration in milliseconds. When set, the solve starts from a few samples and adds more only while the curve keeps changing and time remains, up to the samples count. 0 always uses every sample.");
+    calibration_budget_param->setParent(*advanced_group);
+
+    target_coverage_param->setDefault(0.9);
+    target_coverage_param->setRange(0, 1);
+    target_coverage_param->setDisplayRange(0, 1);
+    target_coverage_param->setLabel("target coverage");
+    target_coverage_param->setHint("Fraction of response curve bins the samples should hit before a budgeted calibration stops adding samples.");
+    target_coverage_param->setParent(*advanced_group);
+
+    share_calibration_param->appendOption("off");
+    share_calibration_param->appendOption("same sources");
+    share_calibration_param->appendOption("same settings");
+    share_calibration_param->setDefault(1);
+    share_calibration_param->setParent(*advanced_group);
+    share_calibration_param->setLabel("share calibration");
+    share_calibration_param->setHint("Share solved response curves between MakeHDR nodes in the session. same sources reuses a curve solved from identical sampled pixels, exposures and solver settings, so several nodes on one bracket set solve once. same settings only matches exposures and solver settings, for example to let the views of a stereo pair use one curve.");
+
+    bracket_update_param->appendOption("recalibrate");
+    bracket_update_param->appendOption("re-merge changed sources");
+    bracket_update_param->setDefault(0);
+    bracket_update_param->setParent(*advanced_group);
+    bracket_update_param->setLabel("bracket update");
+    bracket_update_param->setHint("What editing one exposure time or source clip costs. recalibrate solves the response again and merges every source. re-merge changed sources keeps the merged sums of the last render, and only takes out and adds back the sources that changed, so replacing one source clip re-merges that source alone. An exposure time is part of the calibration, so fixing one re-merges that source alone only when the curve comes from a profile or calibration is off, otherwise the curve is solved again and every source merged. Finding what changed takes the clip changes the host reports and a hash of 64 rows per source. Only the last rendered frame is kept, a render of another frame merges in full. Holds 28 bytes per pixel plus 6 per pixel and source, and is not used with deghost or pack sources.");
+
+    memory_budget_param->setDefault(0);
+    memory_budget_param->setRange(0, 1 << 20);
+    memory_budget_param->setDisplayRange(0, 16384);
+    memory_budget_param->setLabel("memory budget");
+    memory_budget_param->setHint("Memory in MB the response solve may use, 0 for no limit. Channels are solved fewer at a time when the selected solver does not fit three times over, and debevec steps down to mixed precision, then to debevec iterative, when not even one channel fits. Keeps farm tasks within their memory reservation at 12 bit, where dense debevec needs hundreds of MB per channel. Peak usage is logged at debug level.");
+    memory_budget_param->setParent(*advanced_group);
+
     log_level_param->appendOption("off");
     log_level_param->appendOption("error");
     log_level_param->appendOption("warn");
@@ -9,8 +9,7 @@
 #define effect_h
 
 #include "processor.h"
-#include <unordered_set>
-#include <cstdint>
+#include "profile.h"
 
 
 template <class ptype>
@@ -28,13 +27,20 @@ public:
         }
 
         _dst_clip = fetchClip(kOfxImageEffectOutputClipName);
+        _changed_slots.assign(SRC_MAX, false);
     }
 
     ~Effect()
     {
+        _closing = true;
+        cancel_calibration();
+
+        if (_calib_thread.joinable())
+            _calib_thread.join();
     }
 
     virtual void changedParam(const OFX::InstanceChangedArgs& args, const std::string& paramName);
+    virtual void changedClip(const OFX::InstanceChangedArgs& args, const std::string& clipName);
     virtual void render(const OFX::RenderArguments& args);
 
     void process(Processor<ptype>& processor, const OFX::RenderArguments& args);
@@ -47,10 +53,40 @@ public:
     const std::vector<float>& input_weights() { return _input_weights; }
 
     std::vector<fx::point>& sample_points() { return _sample_points; }
-    std::unordered_set<int64_t>& sample_set() { return _sample_set; }
     
     void set_input_weights(int size);
 
+    bool calibrated(int depth) { return _calibrated_depth == depth; }
+    void set_calibrated_depth(int depth) { _calibrated_depth = depth; }
+
+    bool calibration_running() { return _calib_running; }
+    void start_calibration(int depth, const std::function<bool(std::vector<double>&, const fx::cancel_token&)>& solve);
+    void cancel_calibration();
+    bool adopt_calibration();
+
+    bool cached_offsets(const double& time, std::vector<fx::point>& offsets);
+    void cache_offsets(const double& time, const std::vector<fx::point>& offsets);
+    void invalidate_offsets();
+
+    fx::merge_cache& merge_cache() { return _merge_cache; }
+    std::mutex& merge_cache_mutex() { return _merge_cache_mutex; }
+    fx::memory_scope& merge_cache_memory() { return _merge_cache_memory; }
+
+    std::vector<bool> take_changed_slots();
+
+    /// Source slot of an input clip or exposure time param named srcN, -1 for other names.
+    int slot_index(const std::string& name)
+    {
+        for (int i = 0; i < SRC_MAX; ++i)
+            if (name == "src" + std::to_string(i + 1))
+                return i;
+
+        return -1;
+    }
+
+    bool apply_profile(const std::string& path, int depth);
+    void export_profile(const double& time);
+
     double* response(int depth, int channel) { return _response.data() + (depth * channel); }
     void set_response_size(int depth, int channel) { _response.resize(depth * channel); }
 
@@ -58,9 +94,19 @@ public:
     void set_response_linear_size(int depth) { _response_linear.resize(depth); }
 
     float exposure(const double& time) { return (float)_exposure->getValueAtTime(time); }
+    bool fusion(const double& time) { int mode; _mode->getValueAtTime(time, mode); return mode == 1; }
+    float fusion_contrast(const double& time) { return (float)_fusion_contrast->getValueAtTime(time); }
+    float fusion_saturation(const double& time) { return (float)_fusion_saturation->getValueAtTime(time); }
+    float fusion_exposedness(const double& time) { return (float)_fusion_exposedness->getValueAtTime(time); }
     float gamma(const double& time) { return (float)_gamma->getValueAtTime(time); }
     float highlights(const double& time) { return (float)_highlights->getValueAtTime(time); }
+    bool local_tone_mapping(const double& time) { int op; _tone_operator->getValueAtTime(time, op); return op == 1; }
+    float base_range(const double& time) { return (float)_base_range->getValueAtTime(time); }
+    float detail(const double& time) { return (float)_detail->getValueAtTime(time); }
     bool calibrate(const double& time) { bool val; _calibrate->getValueAtTime(time, val); return val; }
+    bool async_calibration(const double& time) { bool val; _async_calibration->getValueAtTime(time, val); return val; }
+    bool use_profile(const double& time) { bool val; _use_profile->getValueAtTime(time, val); return val; }
+    std::string profile_file(const double& time) { std::string val; _profile_file->getValueAtTime(time, val); return val; }
     bool use_middle_gray(const double& time) { bool val; _use_middle_gray->getValueAtTime(time, val); return val; }
     float middle_gray(const double& time)
     {
@@ -70,8 +116,18 @@ public:
     }
     bool show_samples(const double& time) { bool val; _show_samples->getValueAtTime(time, val); return val; }
     int samples(const double& time) { return _samples->getValueAtTime(time); }
+    bool align(const double& time) { bool val; _align->getValueAtTime(time, val); return val; }
+    int align_shift(const double& time) { return _align_shift->getValueAtTime(time); }
+    bool deghost(const double& time) { bool val; _deghost->getValueAtTime(time, val); return val; }
+    float deghost_threshold(const double& time) { return (float)_deghost_threshold->getValueAtTime(time); }
+    bool pack_sources(const double& time) { bool val; _pack_sources->getValueAtTime(time, val); return val; }
     int solver_type(const double& time) { int type; _solver->getValueAtTime(time, type); return type; }
     float smoothness(const double& time) { return (float)_smoothness->getValueAtTime(time); }
+    int calibration_budget(const double& time) { return _calibration_budget->getValueAtTime(time); }
+    float target_coverage(const double& time) { return (float)_target_coverage->getValueAtTime(time); }
+    int share_calibration(const double& time) { int share; _share_calibration->getValueAtTime(time, share); return share; }
+    int bracket_update(const double& time) { int update; _bracket_update->getValueAtTime(time, update); return update; }
+    int memory_budget(const double& time) { return _memory_budget->getValueAtTime(time); }
     int input_depth(const double& time) { int depth; _input_depth->getValueAtTime(time, depth); return _input_depths[depth]; }
     int log_level(const double& time) { int level; _log_level->getValueAtTime(time, level); return level; }
 
@@ -79,27 +135,70 @@ protected:
     fx::timer _timer;
 
     bool _regen_calib = true;
+    int _calibrated_depth = 0;
     int _input_depths[3] = { 256, 1024, 4096 };
 
     std::vector<float> _input_weights;
     std::vector<double> _response;
     std::vector<double> _response_linear;
     std::vector<fx::point> _sample_points;
-    std::unordered_set<int64_t> _sample_set;
+    std::vector<fx::point> _offsets;
+    double _offsets_time = 0;
+    bool _offsets_valid = false;
+    std::mutex _offsets_mutex;
+
+    std::thread _calib_thread;
+    std::mutex _calib_mutex;
+    std::atomic<bool> _calib_running{ false };
+    std::shared_ptr<fx::cancel_token> _calib_cancel;
+    std::vector<double> _calib_result;
+    int _calib_result_depth = 0;
+    std::atomic<bool> _closing{ false };
+
+    fx::merge_cache _merge_cache;
+    std::mutex _merge_cache_mutex;
+    fx::memory_scope _merge_cache_memory{ fx::memory_ledger::instance().images };
+    std::mutex _changed_slots_mutex;
+    std::vector<bool> _changed_slots;
+
+    fx::profile _profile;
+    std::string _profile_path;
 
     OFX::Clip* _dst_clip;
     std::vector<OFX::Clip*> _src_clips;
     std::vector<OFX::DoubleParam*> _exp_times;
 
+    OFX::ChoiceParam* _mode = fetchChoiceParam("mode");
+    OFX::DoubleParam* _fusion_contrast = fetchDoubleParam("fusion_contrast");
+    OFX::DoubleParam* _fusion_saturation = fetchDoubleParam("fusion_saturation");
+    OFX::DoubleParam* _fusion_exposedness = fetchDoubleParam("fusion_exposedness");
     OFX::DoubleParam* _exposure = fetchDoubleParam("exposure");
     OFX::DoubleParam* _gamma = fetchDoubleParam("gamma");
     OFX::DoubleParam* _highlights = fetchDoubleParam("highlights");
+    OFX::ChoiceParam* _tone_operator = fetchChoiceParam("tone_operator");
+    OFX::DoubleParam* _base_range = fetchDoubleParam("base_range");
+    OFX::DoubleParam* _detail = fetchDoubleParam("detail");
     OFX::BooleanParam* _calibrate = fetchBooleanParam("calibrate");
+    OFX::BooleanParam* _async_calibration = fetchBooleanParam("async_calibration");
+    OFX::IntParam* _calib_serial = fetchIntParam("calib_serial");
+    OFX::BooleanParam* _use_profile = fetchBooleanParam("use_profile");
+    OFX::StringParam* _profile_file = fetchStringParam("profile_file");
+    OFX::StringParam* _profile_camera = fetchStringParam("profile_camera");
     OFX::BooleanParam* _use_middle_gray = fetchBooleanParam("use_middle_gray");
     OFX::RGBAParam* _middle_gray = fetchRGBAParam("middle_gray");
     OFX::BooleanParam* _show_samples = fetchBooleanParam("show_samples");
     OFX::IntParam* _samples = fetchIntParam("samples");
+    OFX::BooleanParam* _align = fetchBooleanParam("align");
+    OFX::IntParam* _align_shift = fetchIntParam("align_shift");
+    OFX::BooleanParam* _deghost = fetchBooleanParam("deghost");
+    OFX::DoubleParam* _deghost_threshold = fetchDoubleParam("deghost_threshold");
+    OFX::BooleanParam* _pack_sources = fetchBooleanParam("pack_sources");
     OFX::DoubleParam* _smoothness = fetchDoubleParam("smoothness");
+    OFX::IntParam* _calibration_budget = fetchIntParam("calibration_budget");
+    OFX::DoubleParam* _target_coverage = fetchDoubleParam("target_coverage");
+    OFX::ChoiceParam* _share_calibration = fetchChoiceParam("share_calibration");
+    OFX::ChoiceParam* _bracket_update = fetchChoiceParam("bracket_update");
+    OFX::IntParam* _memory_budget = fetchIntParam("memory_budget");
     OFX::ChoiceParam* _solver = fetchChoiceParam("solver");
     OFX::ChoiceParam* _input_depth = fetchChoiceParam("input_depth");
     OFX::ChoiceParam* _log_level = fetchChoiceParam("log_level");   
@@ -0,0 +1,354 @@
+//
+//  fusion.h
+//  MakeHDR
+//
+//  Created by Vahan Sosoyan 2024.
+//
+
+#ifndef fusion_h
+#define fusion_h
+
+#include "resources.h"
+
+#define FUSION_MIN_LEVEL 8
+#define FUSION_MAX_LEVELS 12
+
+
+namespace fx
+{
+    /// Reads row y of source i as clamped interleaved rgb floats.
+    typedef std::function<void(int, int, float*)> fusion_reader;
+
+    /// Interleaved float image used for every pyramid level.
+    struct fusion_buffer
+    {
+    public:
+        void resize(const int w, const int h, const int c)
+        {
+            width = w;
+            height = h;
+            channels = c;
+            data.resize((size_t)w * h * c);
+        }
+
+        float* row(const int y) { return data.data() + (size_t)y * width * channels; }
+        const float* row(const int y) const { return data.data() + (size_t)y * width * channels; }
+
+        int width = 0;
+        int height = 0;
+        int channels = 0;
+        std::vector<float> data;
+    };
+
+    /// Mertens exposure fusion (Mertens, Kautz, Van Reeth 2007): every source is weighted
+    /// per pixel by contrast, saturation and well-exposedness, and the sources are blended
+    /// through Laplacian pyramids so the weight seams disappear. The result is display
+    /// referred, no response curve or tone mapping is involved.
+    ///
+    /// Sources are streamed through the reader twice, once for the weight normalisation and
+    /// once for the blend, so memory stays constant in the number of sources. Scratch levels
+    /// are allocated once and reused for every source; each level pass runs over rows in parallel.
+    class fusion
+    {
+    public:
+        fusion(const int width,
+               const int height,
+               const float contrast,
+               const float saturation,
+               const float exposedness) : _contrast(contrast),
+                                          _saturation(saturation),
+                                          _exposedness(exposedness)
+        {
+            int levels = 1;
+            while (levels < FUSION_MAX_LEVELS && std::min(width, height) >> levels >= FUSION_MIN_LEVEL)
+                ++levels;
+
+            _image.resize(levels);
+            _weight.resize(levels);
+            _result.resize(levels);
+            _expand.resize(levels);
+
+            int w = width, h = height;
+            for (int l = 0; l < levels; ++l)
+            {
+                _image[l].resize(w, h, CMP_MAX);
+                _weight[l].resize(w, h, 1);
+                _expand[l].resize(w, h, CMP_MAX);
+                _result[l].resize(w, h, CMP_MAX);
+                std::fill(_result[l].data.begin(), _result[l].data.end(), 0.f);
+
+                w = (w + 1) / 2;
+                h = (h + 1) / 2;
+            }
+
+            _weight_sum.resize(width, height, 1);
+            std::fill(_weight_sum.data.begin(), _weight_sum.data.end(), 0.f);
+        }
+
+        /// Fuses count sources, returns false if aborted.
+        bool run(const int count, const fusion_reader& read, const std::function<bool()>& aborted)
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                if (aborted()) return false;
+
+                read_source(i, read);
+                measure(_weight[0]);
+
+                parallel_rows(_weight_sum.height, [&](int first, int last)
+                {
+                    for (size_t p = (size_t)first * _weight_sum.width; p < (size_t)last * _weight_sum.width; ++p)
+                        _weight_sum.data[p] += _weight[0].data[p];
+                });
+            }
+
+            for (int i = 0; i < count; ++i)
+            {
+                if (aborted()) return false;
+
+                read_source(i, read);
+                measure(_weight[0]);
+
+                parallel_rows(_weight_sum.height, [&](int first, int last)
+                {
+                    for (size_t p = (size_t)first * _weight_sum.width; p < (size_t)last * _weight_sum.width; ++p)
+                        _weight[0].data[p] /= _weight_sum.data[p];
+                });
+
+                for (int l = 1; l < (int)_image.size(); ++l)
+                {
+                    reduce(_image[l - 1], _image[l]);
+                    reduce(_weight[l - 1], _weight[l]);
+                }
+
+                accumulate();
+            }
+
+            collapse();
+            return true;
+        }
+
+        /// Fused rgb at full resolution, valid after run.
+        const fusion_buffer& result() const { return _result[0]; }
+
+    private:
+        void read_source(const int i, const fusion_reader& read)
+        {
+            parallel_rows(_image[0].height, [&](int first, int last)
+            {
+                for (int y = first; y < last; ++y)
+                    read(i, y, _image[0].row(y));
+            });
+        }
+
+        /// Contrast as the absolute Laplacian of the gray image, saturation as the standard
+        /// deviation of the channels, well-exposedness as a gaussian around 0.5 per channel.
+        void measure(fusion_buffer& weight)
+        {
+            const fusion_buffer& image = _image[0];
+            const int w = image.width;
+            const int h = image.height;
+
+            parallel_rows(h, [&](int first, int last)
+            {
+                auto gray = [&](int x, int y)
+                {
+                    const float* pixel = image.row(std::min(std::max(y, 0), h - 1)) + std::min(std::max(x, 0), w - 1) * CMP_MAX;
+                    return (pixel[ch::r] + pixel[ch::g] + pixel[ch::b]) / 3.f;
+                };
+
+                for (int y = first; y < last; ++y)
+                {
+                    const float* pixel = image.row(y);
+                    float* out = weight.row(y);
+
+                    for (int x = 0; x < w; ++x, pixel += CMP_MAX)
+                    {
+                        const float mean = (pixel[ch::r] + pixel[ch::g] + pixel[ch::b]) / 3.f;
+                        const float contrast = std::abs(gray(x - 1, y) + gray(x + 1, y) + gray(x, y - 1) + gray(x, y + 1) - 4.f * mean);
+
+                        float variance = 0.f;
+                        float exposedness = 1.f;
+
+                        for (int c = 0; c < CMP_MAX; ++c)
+                        {
+                            variance += (pixel[c] - mean) * (pixel[c] - mean);
+                            exposedness *= std::exp(-(pixel[c] - 0.5f) * (pixel[c] - 0.5f) / 0.08f);
+                        }
+
+                        out[x] = std::pow(contrast, _contrast) *
+                                 std::pow(std::sqrt(variance / CMP_MAX), _saturation) *
+                                 std::pow(exposedness, _exposedness) + 1e-12f;
+                    }
+                }
+            });
+        }
+
+        /// Gaussian reduce with the 5 tap binomial kernel, clamped at the borders.
+        void reduce(const fusion_buffer& src, fusion_buffer& dst)
+        {
+            static const float kernel[5] = { 1.f / 16, 4.f / 16, 6.f / 16, 4.f / 16, 1.f / 16 };
+            const int channels = src.channels;
+
+            parallel_rows(dst.height, [&](int first, int last)
+            {
+                std::vector<float> row((size_t)src.width * channels);
+
+                for (int y = first; y < last; ++y)
+                {
+                    std::fill(row.begin(), row.end(), 0.f);
+
+                    for (int k = -2; k <= 2; ++k)
+                    {
+                        const float* line = src.row(std::min(std::max(2 * y + k, 0), src.height - 1));
+
+                        for (size_t i = 0; i < row.size(); ++i)
+                            row[i] += kernel[k + 2] * line[i];
+                    }
+
+                    float* out = dst.row(y);
+
+                    for (int x = 0; x < dst.width; ++x)
+                    {
+                        for (int c = 0; c < channels; ++c)
+                        {
+                            float value = 0.f;
+
+                            for (int k = -2; k <= 2; ++k)
+                                value += kernel[k + 2] * row[std::min(std::max(2 * x + k, 0), src.width - 1) * channels + c];
+
+                            out[x * channels + c] = value;
+                        }
+                    }
+                }
+            });
+        }
+
+        /// Gaussian expand of src to the size of dst, the transpose of reduce scaled by 4.
+        void expand(const fusion_buffer& src, fusion_buffer& dst)
+        {
+            const int channels = src.channels;
+
+            auto taps = [](int i, int size, int* index, float* weight)
+            {
+                if (i % 2 == 0)
+                {
+                    index[0] = std::max(i / 2 - 1, 0); weight[0] = 1.f / 8;
+                    index[1] = std::min(i / 2, size - 1); weight[1] = 6.f / 8;
+                    index[2] = std::min(i / 2 + 1, size - 1); weight[2] = 1.f / 8;
+                }
+                else
+                {
+                    index[0] = std::min((i - 1) / 2, size - 1); weight[0] = 4.f / 8;
+                    index[1] = std::min((i + 1) / 2, size - 1); weight[1] = 4.f / 8;
+                    index[2] = index[1]; weight[2] = 0.f;
+                }
+            };
+
+            parallel_rows(dst.height, [&](int first, int last)
+            {
+                std::vector<float> row((size_t)src.width * channels);
+
+                for (int y = first; y < last; ++y)
+                {
+                    int rows[3];
+                    float row_weights[3];
+                    taps(y, src.height, rows, row_weights);
+
+                    std::fill(row.begin(), row.end(), 0.f);
+
+                    for (int k = 0; k < 3; ++k)
+                    {
+                        const float* line = src.row(rows[k]);
+
+                        for (size_t i = 0; i < row.size(); ++i)
+                            row[i] += row_weights[k] * line[i];
+                    }
+
+                    float* out = dst.row(y);
+
+                    for (int x = 0; x < dst.width; ++x)
+                    {
+                        int columns[3];
+                        float column_weights[3];
+                        taps(x, src.width, columns, column_weights);
+
+                        for (int c = 0; c < channels; ++c)
+                        {
+                            out[x * channels + c] = column_weights[0] * row[columns[0] * channels + c] +
+                                                    column_weights[1] * row[columns[1] * channels + c] +
+                                                    column_weights[2] * row[columns[2] * channels + c];
+                        }
+                    }
+                }
+            });
+        }
+
+        /// Adds the weighted Laplacian levels of the current source to the result pyramid,
+        /// the coarsest level takes the weighted Gaussian level itself.
+        void accumulate()
+        {
+            const int top = (int)_image.size() - 1;
+
+            for (int l = 0; l <= top; ++l)
+            {
+                if (l < top)
+                    expand(_image[l + 1], _expand[l]);
+
+                fusion_buffer& image = _image[l];
+                fusion_buffer& weight = _weight[l];
+                fusion_buffer& result = _result[l];
+                fusion_buffer& expanded = _expand[l];
+
+                parallel_rows(image.height, [&](int first, int last)
+                {
+                    for (int y = first; y < last; ++y)
+                    {
+                        const float* pixel = image.row(y);
+                        const float* blur = expanded.row(y);
+                        const float* w = weight.row(y);
+                        float* out = result.row(y);
+
+                        for (int x = 0; x < image.width; ++x)
+                        {
+                            for (int c = 0; c < CMP_MAX; ++c)
+                            {
+                                const float detail = l < top ? pixel[x * CMP_MAX + c] - blur[x * CMP_MAX + c] : pixel[x * CMP_MAX + c];
+                                out[x * CMP_MAX + c] += w[x] * detail;
+                            }
+                        }
+                    }
+                });
+            }
+        }
+
+        void collapse()
+        {
+            for (int l = (int)_result.size() - 2; l >= 0; --l)
+            {
+                expand(_result[l + 1], _expand[l]);
+
+                fusion_buffer& result = _result[l];
+                const fusion_buffer& expanded = _expand[l];
+
+                parallel_rows(result.height, [&](int first, int last)
+                {
+                    for (size_t i = (size_t)first * result.width * CMP_MAX; i < (size_t)last * result.width * CMP_MAX; ++i)
+                        result.data[i] += expanded.data[i];
+                });
+            }
+        }
+
+        float _contrast;
+        float _saturation;
+        float _exposedness;
+
+        std::vector<fusion_buffer> _image;
+        std::vector<fusion_buffer> _weight;
+        std::vector<fusion_buffer> _expand;
+        std::vector<fusion_buffer> _result;
+        fusion_buffer _weight_sum;
+    };
+}
+
+#endif
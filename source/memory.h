@@ -0,0 +1,108 @@
+//
+//  memory.h
+//  MakeHDR
+//
+//  Created by Vahan Sosoyan 2024.
+//
+
+#ifndef memory_h
+#define memory_h
+
+#include "resources.h"
+
+
+namespace fx
+{
+    /// Bytes held by one kind of allocation across every node of the process, and their peak.
+    class memory_account
+    {
+    public:
+        explicit memory_account(const char* name) : _name(name)
+        {
+        }
+
+        void add(const size_t bytes)
+        {
+            const size_t current = _current += bytes;
+            size_t peak = _peak;
+
+            while (current > peak && !_peak.compare_exchange_weak(peak, current))
+            {
+            }
+        }
+
+        void remove(const size_t bytes) { _current -= bytes; }
+
+        const char* name() const { return _name; }
+        size_t current() const { return _current; }
+        size_t peak() const { return _peak; }
+
+    private:
+        const char* _name;
+        std::atomic<size_t> _current{ 0 };
+        std::atomic<size_t> _peak{ 0 };
+    };
+
+    /// Process wide accounts of the large allocations: solver systems, estimated from their
+    /// dimensions, sample bins, and images cached or packed between and during renders.
+    class memory_ledger
+    {
+    public:
+        static memory_ledger& instance()
+        {
+            static memory_ledger ledger;
+            return ledger;
+        }
+
+        void report() const
+        {
+            const double mb = 1.0 / (1 << 20);
+
+            spdlog::debug("[{}] memory {}: {:.1f}MB, peak {:.1f}MB, {}: {:.1f}MB, peak {:.1f}MB, {}: {:.1f}MB, peak {:.1f}MB", fx::label,
+                solver.name(), solver.current() * mb, solver.peak() * mb,
+                samples.name(), samples.current() * mb, samples.peak() * mb,
+                images.name(), images.current() * mb, images.peak() * mb);
+        }
+
+        memory_account solver{ "solver" };
+        memory_account samples{ "samples" };
+        memory_account images{ "images" };
+
+    private:
+        memory_ledger() = default;
+    };
+
+    /// Holds bytes on an account until destroyed or set to another size.
+    class memory_scope
+    {
+    public:
+        explicit memory_scope(memory_account& account, const size_t bytes = 0) : _account(account)
+        {
+            set(bytes);
+        }
+
+        memory_scope(const memory_scope&) = delete;
+        memory_scope& operator=(const memory_scope&) = delete;
+
+        ~memory_scope()
+        {
+            set(0);
+        }
+
+        void set(const size_t bytes)
+        {
+            if (bytes > _bytes)
+                _account.add(bytes - _bytes);
+            else
+                _account.remove(_bytes - bytes);
+
+            _bytes = bytes;
+        }
+
+    private:
+        memory_account& _account;
+        size_t _bytes = 0;
+    };
+}
+
+#endif
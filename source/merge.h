@@ -0,0 +1,409 @@
+//
+//  merge.h
+//  MakeHDR
+//
+//  Created by Vahan Sosoyan 2024.
+//
+
+#ifndef merge_h
+#define merge_h
+
+#include "resources.h"
+
+#define MERGE_BLOCK 64
+#define DEGHOST_TILE 16
+#define DEGHOST_STEP 4
+
+
+namespace fx
+{
+    /// Lookup tables shared by every pixel of a merge: the bin weights and
+    /// the log response per channel, converted to float once per render.
+    struct merge_tables
+    {
+    public:
+        void set(const int input_depth, const std::vector<float>& input_weights, const double* response, const bool shared)
+        {
+            depth = input_depth;
+            weights.assign(input_weights.begin(), input_weights.end());
+
+            for (int c = 0; c < CMP_MAX; ++c)
+            {
+                const double* curve = shared ? response : response + input_depth * c;
+                this->response[c].assign(curve, curve + input_depth);
+            }
+
+            min_weight = FLT_MAX;
+            for (const float weight : weights)
+                if (weight > 0.f)
+                    min_weight = std::min(min_weight, weight / CMP_MAX);
+        }
+
+        bool empty() const { return depth == 0; }
+
+        int depth = 0;
+        float min_weight = 0.f;
+        std::vector<float> weights;
+        std::vector<float> response[CMP_MAX];
+    };
+
+    /// Accumulated weighted log radiance of a block of pixels on one row.
+    /// Sources are added one at a time so the block state stays in L1.
+    struct merge_block
+    {
+    public:
+        void clear(const int count)
+        {
+            size = count;
+            std::fill(weight, weight + count, 0.f);
+            std::fill(&sum[0][0], &sum[0][0] + count * CMP_MAX, 0.f);
+            std::fill(&fallback[0][0], &fallback[0][0] + count * CMP_MAX, 0.f);
+        }
+
+        int size = 0;
+        float weight[MERGE_BLOCK];
+        float sum[MERGE_BLOCK][CMP_MAX];
+        float fallback[MERGE_BLOCK][CMP_MAX];
+    };
+
+    /// Adds the weighted log radiance of block pixels [first, last) given their bins and weights.
+    inline void merge_accumulate(const merge_tables& tables,
+                                 const int bins[MERGE_BLOCK][CMP_MAX],
+                                 const float weights[MERGE_BLOCK],
+                                 const float exp_time_log,
+                                 const int first,
+                                 const int last,
+                                 merge_block& block)
+    {
+        for (int p = first; p < last; ++p)
+        {
+            const float weight = weights[p];
+
+            if (weight == 0.f)
+                continue;
+
+            for (int c = 0; c < CMP_MAX; ++c)
+                block.sum[p][c] += weight * (tables.response[c][bins[p][c]] - exp_time_log);
+
+            block.weight[p] += weight;
+        }
+    }
+
+    /// Adds a row segment of one source to block pixels [first, last), src pointing at the
+    /// pixel for first. Returns false when every pixel lands on a zero weight bin (fully clipped
+    /// or black), in which case the response lookups and accumulation are skipped. The darkest
+    /// source also fills the fallback used for pixels without any weight, using the raw value
+    /// when above 1 (genuine HDR in linear float), otherwise the response curve at the clipped bin.
+    /// Weights are scaled by gain, which deghosting lowers for sources inconsistent in a tile.
+    template<typename ptype>
+    inline bool merge_source(const merge_tables& tables,
+                             const ptype* src,
+                             const int components,
+                             const float exp_time_log,
+                             const bool darkest,
+                             const int first,
+                             const int last,
+                             merge_block& block,
+                             const float gain = 1.f)
+    {
+        int bins[MERGE_BLOCK][CMP_MAX];
+        float weights[MERGE_BLOCK];
+        bool active = false;
+
+        const float scale = (float)(tables.depth - 1);
+        const float* lut = tables.weights.data();
+
+        for (int p = first; p < last; ++p)
+        {
+            const ptype* pixel = src + (p - first) * components;
+            float weight = 0.f;
+
+            for (int c = 0; c < CMP_MAX; ++c)
+            {
+                const ptype sample = std::min<ptype>(std::max<ptype>(pixel[c], 0.f), 1.f);
+                bins[p][c] = (int)(sample * scale);
+                weight += lut[bins[p][c]];
+            }
+
+            weights[p] = gain * weight / CMP_MAX;
+            active |= weights[p] > 0.f;
+        }
+
+        if (darkest)
+        {
+            for (int p = first; p < last; ++p)
+            {
+                for (int c = 0; c < CMP_MAX; ++c)
+                {
+                    const float raw = (float)src[(p - first) * components + c];
+                    block.fallback[p][c] = raw > 1.0f
+                        ? std::log(raw) - exp_time_log
+                        : tables.response[c][bins[p][c]] - exp_time_log;
+                }
+            }
+        }
+
+        if (!active)
+            return false;
+
+        merge_accumulate(tables, bins, weights, exp_time_log, first, last, block);
+        return true;
+    }
+
+    /// merge_source for sources already quantised to bins at the tables' depth, rows[c]
+    /// pointing at the bin of channel c for pixel first. The fallback uses the response
+    /// curve only, since stored bins cannot exceed 1.
+    template<typename btype>
+    inline bool merge_bins(const merge_tables& tables,
+                           const btype* const rows[CMP_MAX],
+                           const float exp_time_log,
+                           const bool darkest,
+                           const int first,
+                           const int last,
+                           merge_block& block)
+    {
+        int bins[MERGE_BLOCK][CMP_MAX];
+        float weights[MERGE_BLOCK];
+        bool active = false;
+
+        const float* lut = tables.weights.data();
+
+        for (int p = first; p < last; ++p)
+        {
+            float weight = 0.f;
+
+            for (int c = 0; c < CMP_MAX; ++c)
+            {
+                bins[p][c] = rows[c][p - first];
+                weight += lut[bins[p][c]];
+            }
+
+            weights[p] = weight / CMP_MAX;
+            active |= weights[p] > 0.f;
+        }
+
+        if (darkest)
+            for (int p = first; p < last; ++p)
+                for (int c = 0; c < CMP_MAX; ++c)
+                    block.fallback[p][c] = tables.response[c][bins[p][c]] - exp_time_log;
+
+        if (!active)
+            return false;
+
+        merge_accumulate(tables, bins, weights, exp_time_log, first, last, block);
+        return true;
+    }
+
+    /// Merges a whole block from sources packed by pixel: the CMP_MAX bins of every source
+    /// next to each other, packed pointing at the first pixel of the block. Each source is
+    /// weighted and accumulated like merge_source, gains scaling the weight of source j.
+    /// The fallback uses the response curve only, since packed bins cannot exceed 1.
+    inline void merge_packed(const merge_tables& tables,
+                             const uint16_t* packed,
+                             const int sources,
+                             const float* exp_times_log,
+                             const float* gains,
+                             const int darkest,
+                             merge_block& block)
+    {
+        const float* lut = tables.weights.data();
+
+        for (int p = 0; p < block.size; ++p)
+        {
+            const uint16_t* pixel = packed + (size_t)p * sources * CMP_MAX;
+
+            for (int j = 0; j < sources; ++j)
+            {
+                const uint16_t* bins = pixel + j * CMP_MAX;
+
+                if (j == darkest)
+                    for (int c = 0; c < CMP_MAX; ++c)
+                        block.fallback[p][c] = tables.response[c][bins[c]] - exp_times_log[j];
+
+                float weight = 0.f;
+                for (int c = 0; c < CMP_MAX; ++c)
+                    weight += lut[bins[c]];
+
+                weight = gains[j] * weight / CMP_MAX;
+
+                if (weight == 0.f)
+                    continue;
+
+                for (int c = 0; c < CMP_MAX; ++c)
+                    block.sum[p][c] += weight * (tables.response[c][bins[c]] - exp_times_log[j]);
+
+                block.weight[p] += weight;
+            }
+        }
+    }
+
+    /// Takes back what merge_source added for a source at gain 1, given the bins it was
+    /// quantised to, CMP_MAX per pixel. Pixels left with less weight than any single
+    /// contribution carries had their last one removed, and are cleared of rounding residue.
+    inline void merge_remove(const merge_tables& tables,
+                             const uint16_t* bins,
+                             const float exp_time_log,
+                             merge_block& block)
+    {
+        const float* lut = tables.weights.data();
+
+        for (int p = 0; p < block.size; ++p)
+        {
+            const uint16_t* pixel = bins + p * CMP_MAX;
+
+            float weight = 0.f;
+            for (int c = 0; c < CMP_MAX; ++c)
+                weight += lut[pixel[c]];
+
+            weight = weight / CMP_MAX;
+
+            if (weight == 0.f)
+                continue;
+
+            for (int c = 0; c < CMP_MAX; ++c)
+                block.sum[p][c] -= weight * (tables.response[c][pixel[c]] - exp_time_log);
+
+            block.weight[p] -= weight;
+
+            if (block.weight[p] < 0.5f * tables.min_weight)
+            {
+                block.weight[p] = 0.f;
+                std::fill(block.sum[p], block.sum[p] + CMP_MAX, 0.f);
+            }
+        }
+    }
+
+    /// Log radiance of a row segment averaged over channels, with the merge weight of every
+    /// pixel in [first, last), src pointing at the pixel for first.
+    template<typename ptype>
+    inline void merge_radiance(const merge_tables& tables,
+                               const ptype* src,
+                               const int components,
+                               const float exp_time_log,
+                               const int first,
+                               const int last,
+                               float radiance[MERGE_BLOCK],
+                               float weights[MERGE_BLOCK])
+    {
+        const float scale = (float)(tables.depth - 1);
+        const float* lut = tables.weights.data();
+
+        for (int p = first; p < last; ++p)
+        {
+            const ptype* pixel = src + (p - first) * components;
+            float weight = 0.f;
+            float sum = 0.f;
+
+            for (int c = 0; c < CMP_MAX; ++c)
+            {
+                const ptype sample = std::min<ptype>(std::max<ptype>(pixel[c], 0.f), 1.f);
+                const int bin = (int)(sample * scale);
+
+                weight += lut[bin];
+                sum += tables.response[c][bin];
+            }
+
+            weights[p] = weight / CMP_MAX;
+            radiance[p] = sum / CMP_MAX - exp_time_log;
+        }
+    }
+
+    /// merge_radiance for bins at the tables' depth, pixel p of the segment at bins + p * stride.
+    inline void merge_radiance_bins(const merge_tables& tables,
+                                    const uint16_t* bins,
+                                    const int stride,
+                                    const float exp_time_log,
+                                    const int first,
+                                    const int last,
+                                    float radiance[MERGE_BLOCK],
+                                    float weights[MERGE_BLOCK])
+    {
+        const float* lut = tables.weights.data();
+
+        for (int p = first; p < last; ++p)
+        {
+            const uint16_t* pixel = bins + (size_t)(p - first) * stride;
+            float weight = 0.f;
+            float sum = 0.f;
+
+            for (int c = 0; c < CMP_MAX; ++c)
+            {
+                weight += lut[pixel[c]];
+                sum += tables.response[c][pixel[c]];
+            }
+
+            weights[p] = weight / CMP_MAX;
+            radiance[p] = sum / CMP_MAX - exp_time_log;
+        }
+    }
+
+    /// How far one source strays from the reference exposure over a tile, as the mean absolute
+    /// log radiance difference of pixels with weight in both. Sources agreeing within threshold
+    /// keep their weight, moving content falls off as 1 / (1 + (difference / threshold)^4).
+    struct deghost_tile
+    {
+    public:
+        void clear()
+        {
+            difference = 0.f;
+            count = 0;
+        }
+
+        void add(const float radiance[MERGE_BLOCK],
+                 const float weights[MERGE_BLOCK],
+                 const float reference[MERGE_BLOCK],
+                 const float reference_weights[MERGE_BLOCK],
+                 const int first,
+                 const int last)
+        {
+            for (int p = first; p < last; ++p)
+            {
+                if (weights[p] > 0.f && reference_weights[p] > 0.f)
+                {
+                    difference += std::abs(radiance[p] - reference[p]);
+                    count++;
+                }
+            }
+        }
+
+        /// Tiles with fewer than minimum comparable pixels, mostly clipped in either exposure,
+        /// cannot tell motion from noise and keep their weight.
+        float gain(const float threshold, const int minimum) const
+        {
+            if (count == 0 || count < minimum)
+                return 1.f;
+
+            const float ratio = difference / count / threshold;
+            const float ratio_2 = ratio * ratio;
+
+            return 1.f / (1.f + ratio_2 * ratio_2);
+        }
+
+        float difference = 0.f;
+        int count = 0;
+    };
+
+    /// Writes the merged block as hdr^(1/gamma) with opaque alpha.
+    template<typename ptype>
+    inline void merge_resolve(const merge_block& block, const float gamma, const int components, ptype* dst)
+    {
+        const float inv_gamma = 1.f / gamma;
+
+        for (int p = 0; p < block.size; ++p)
+        {
+            ptype* pixel = dst + p * components;
+
+            for (int c = 0; c < CMP_MAX; ++c)
+            {
+                const float log_hdr = block.weight[p] > 0.f
+                    ? block.sum[p][c] / block.weight[p]
+                    : block.fallback[p][c];
+                pixel[c] = (ptype)std::exp(log_hdr * inv_gamma);
+            }
+
+            pixel[ch::a] = 1.0f;
+        }
+    }
+}
+
+#endif
@@ -10,6 +10,12 @@
 
 #include "resources.h"
 #include "solver.h"
+#include "merge.h"
+#include "align.h"
+#include "fusion.h"
+#include "tonemap.h"
+#include "registry.h"
+#include "remerge.h"
 
 
 template <class ptype>
@@ -42,95 +48,704 @@ public:
             spdlog::debug("[{}] effect calibrate abort!", fx::label);
             return;
         }
-        if (!_effect.regen_calib() && !_effect.input_weights().empty())
+
+        align_sources();
+
+        if (_fusion)
+            return;
+
+        if (_pack_sources)
+            pack_sources();
+
+        if (_calibrate && _use_profile && _effect.apply_profile(_profile_file, _input_depth))
+        {
+            _effect.set_input_weights(_input_depth);
+            spdlog::debug("[{}] response taken from profile", fx::label);
+        }
+        else if (_calibrate && _async_calibration)
+        {
+            _effect.set_input_weights(_input_depth);
+            calibrate_async();
+        }
+        else if (!_effect.regen_calib() && !_effect.input_weights().empty())
         {
             spdlog::debug("[{}] calibrate skipped!", fx::label);
-            return;
         }
+        else
+        {
+            _effect.set_input_weights(_input_depth);
+            _calibrate ? calibrate() : calibrate_linear();
+        }
+
+        _tables.set(_input_depth,
+                    _effect.input_weights(),
+                    _use_linear ? _effect.response_linear() : _effect.response(_input_depth, 0),
+                    _use_linear);
 
-        _effect.set_input_weights(_input_depth);
-        _calibrate ? calibrate() : calibrate_linear();
+        _darkest = (int)(std::min_element(_exp_times_log.begin(), _exp_times_log.end()) - _exp_times_log.begin());
+        _reference = middle_exposure();
+
+        prepare_cache();
     }
 
+    /// Merges tiles of DEGHOST_TILE rows by MERGE_BLOCK pixels, so deghosting can weigh
+    /// every source once per tile before its rows are merged.
     virtual void multiThreadProcessImages(OfxRectI proc_window)
     {
-        if (_sources.empty()) return;
+        if (_sources.empty() || _tables.empty()) return;
 
+        fx::merge_block block;
+        fx::merge_block scratch;
+        std::vector<fx::deghost_tile> tiles(_sources.size());
+        std::vector<float> gains(_sources.size(), 1.f);
+        int skipped = 0;
 
-        for (int y = proc_window.y1; y < proc_window.y2; ++y)
+        for (int tile_y = proc_window.y1; tile_y < proc_window.y2; tile_y += DEGHOST_TILE)
         {
             if (_effect.abort()) return;
 
-            for (int x = proc_window.x1; x < proc_window.x2; ++x)
+            const int tile_last = std::min(tile_y + DEGHOST_TILE, proc_window.y2);
+
+            for (int x = proc_window.x1; x < proc_window.x2; x += MERGE_BLOCK)
             {
-                float weight_sum = 0.f;
-                float response_log[3] = { 0.f, 0.f, 0.f };
-                float result[3] = { 0.f, 0.f, 0.f };
-                float fallback_log[3] = { 0.f, 0.f, 0.f };
-                float min_exp_log = FLT_MAX;
+                const int size = std::min(MERGE_BLOCK, proc_window.x2 - x);
 
-                ptype* dst = (ptype*)_dstImg->getPixelAddress(x, y);
+                if (_deghost)
+                    deghost(x, tile_y, tile_last, size, tiles, gains);
 
-                for (int i = 0; i < _sources.size(); ++i)
+                for (int y = tile_y; y < tile_last; ++y)
                 {
-                    const ptype* src = (ptype*)_sources[i]->getPixelAddress(x, y);
+                    block.clear(size);
 
-                    if (src == nullptr) return;
-
-                    float weight_src = 0.f;
-
-                    for (int c = 0; c < CMP_MAX; ++c)
+                    if (_remerge)
                     {
-                        const ptype sample = std::min<ptype>(std::max<ptype>(src[c], 0.f), 1.f);
-                        const int bin = (int)(sample * (_input_depth - 1));
-                        weight_src += _effect.input_weights()[bin];
-                        response_log[c] = lookup_response(bin, c);
+                        remerge(x, y, block, scratch);
                     }
-
-                    weight_src /= CMP_MAX;
-
-                    /// Track the darkest source as fallback for fully-clipped pixels.
-                    /// Use raw unclamped value when > 1.0 (genuine HDR in linear float),
-                    /// otherwise use the response curve at bin 255 (clipped at camera max).
-                    if (_exp_times_log[i] < min_exp_log)
+                    else if (!_packed.empty())
                     {
-                        min_exp_log = _exp_times_log[i];
-                        for (int c = 0; c < CMP_MAX; ++c)
+                        fx::merge_packed(_tables, packed_pixel(x, y), (int)_sources.size(), _exp_times_log.data(), gains.data(), _darkest, block);
+                    }
+                    else
+                    {
+                        for (int i = 0; i < _sources.size(); ++i)
                         {
-                            const float raw = (float)src[c];
-                            fallback_log[c] = raw > 1.0f
-                                ? std::log(raw) - _exp_times_log[i]
-                                : response_log[c] - _exp_times_log[i];
+                            if (!merge_shifted(i, x, y, block, gains[i]))
+                                ++skipped;
                         }
                     }
 
-                    for (int c = 0; c < CMP_MAX; ++c)
-                        result[c] += weight_src * (response_log[c] - _exp_times_log[i]);
+                    if (_fill_cache)
+                        fill_cache(x, y, block);
 
-                    weight_sum += weight_src;
+                    fx::merge_resolve(block, _gamma, _components, (ptype*)_dstImg->getPixelAddress(x, y));
                 }
+            }
+        }
+
+        if (skipped > 0)
+            spdlog::debug("[{}] {} source blocks without weight skipped", fx::label, skipped);
+
+    }
+
+    /// Row of source i for the block of size pixels starting at (x, y), shifted by its alignment
+    /// offset. Block pixels [first, last) fall inside the source bounds, the returned pointer
+    /// is at the pixel for first.
+    const ptype* shifted_row(const int i, const int x, const int y, const int size, int& first, int& last)
+    {
+        const fx::point& offset = _offsets[i];
+        const int sx = x + offset.x;
+        const int sy = std::min(std::max(y + offset.y, _bounds.y1), _bounds.y2 - 1);
+
+        first = std::min(size, std::max(0, _bounds.x1 - sx));
+        last = std::max(first, std::min(size, _bounds.x2 - sx));
+
+        return (const ptype*)_sources[i]->getPixelAddress(sx + first, sy);
+    }
+
+    /// Adds source i to the block starting at (x, y), shifted by its alignment offset.
+    /// Pixels shifted past the source bounds repeat the edge pixel of the row.
+    bool merge_shifted(const int i, const int x, const int y, fx::merge_block& block, const float gain)
+    {
+        const fx::point& offset = _offsets[i];
+        const int sy = std::min(std::max(y + offset.y, _bounds.y1), _bounds.y2 - 1);
+        const bool darkest = i == _darkest;
+        bool active = false;
+
+        int first, last;
+        const ptype* src = shifted_row(i, x, y, block.size, first, last);
+        const ptype* left = (ptype*)_sources[i]->getPixelAddress(_bounds.x1, sy);
+        const ptype* right = (ptype*)_sources[i]->getPixelAddress(_bounds.x2 - 1, sy);
+
+        if (src != nullptr && first < last)
+            active |= fx::merge_source(_tables, src, _components, _exp_times_log[i], darkest, first, last, block, gain);
+
+        for (int p = 0; p < first && left != nullptr; ++p)
+            active |= fx::merge_source(_tables, left, _components, _exp_times_log[i], darkest, p, p + 1, block, gain);
+
+        for (int p = last; p < block.size && right != nullptr; ++p)
+            active |= fx::merge_source(_tables, right, _components, _exp_times_log[i], darkest, p, p + 1, block, gain);
+
+        return active;
+    }
+
+    /// Per tile ghost rejection. Every DEGHOST_STEP-th row of the tile is converted to log
+    /// radiance through the calibrated response, for the middle exposure and each other source,
+    /// and sources whose radiance disagrees with the reference get their merge weight lowered
+    /// for the whole tile. Tiles are small enough for moving content to dominate the ones it
+    /// crosses, and the rows read here are still in cache when the tile is merged.
+    void deghost(const int x,
+                 const int y,
+                 const int y_last,
+                 const int size,
+                 std::vector<fx::deghost_tile>& tiles,
+                 std::vector<float>& gains)
+    {
+        float reference[MERGE_BLOCK];
+        float reference_weights[MERGE_BLOCK];
+        float radiance[MERGE_BLOCK];
+        float weights[MERGE_BLOCK];
+
+        for (fx::deghost_tile& tile : tiles)
+            tile.clear();
+
+        int rows = 0;
+
+        for (int row = y; row < y_last; row += DEGHOST_STEP, ++rows)
+        {
+            int first, last;
+
+            if (!source_radiance(_reference, x, row, size, first, last, reference, reference_weights))
+                continue;
+
+            for (int i = 0; i < (int)_sources.size(); ++i)
+            {
+                int source_first, source_last;
+
+                if (i == _reference || !source_radiance(i, x, row, size, source_first, source_last, radiance, weights))
+                    continue;
+
+                const int lo = std::max(first, source_first);
+                const int hi = std::min(last, source_last);
+
+                if (lo < hi)
+                    tiles[i].add(radiance, weights, reference, reference_weights, lo, hi);
+            }
+        }
+
+        const float threshold = _deghost_threshold * std::log(2.f);
+        const int minimum = std::max(1, size * rows / 8);
+
+        for (int i = 0; i < (int)_sources.size(); ++i)
+            gains[i] = i == _reference ? 1.f : tiles[i].gain(threshold, minimum);
+    }
+
+    /// Log radiance of source i over the block of size pixels at (x, y), from the packed bins
+    /// when present, otherwise from block pixels [first, last) inside the source bounds.
+    bool source_radiance(const int i,
+                         const int x,
+                         const int y,
+                         const int size,
+                         int& first,
+                         int& last,
+                         float radiance[MERGE_BLOCK],
+                         float weights[MERGE_BLOCK])
+    {
+        if (!_packed.empty())
+        {
+            first = 0;
+            last = size;
+            fx::merge_radiance_bins(_tables, packed_pixel(x, y) + i * CMP_MAX, (int)_sources.size() * CMP_MAX,
+                                    _exp_times_log[i], first, last, radiance, weights);
+            return true;
+        }
+
+        const ptype* src = shifted_row(i, x, y, size, first, last);
+
+        if (src == nullptr || first >= last)
+            return false;
+
+        fx::merge_radiance(_tables, src, _components, _exp_times_log[i], first, last, radiance, weights);
+        return true;
+    }
+
+    /// Converts every source once into bins at the input depth, packed by pixel over the render
+    /// window with the bins of all sources next to each other and alignment offsets applied,
+    /// so the merge reads one contiguous uint16 stream instead of a float stream per source.
+    /// Shifted pixels past the bounds repeat the edge pixel, as in merge_shifted.
+    void pack_sources()
+    {
+        fx::timer timer;
+
+        const int count = (int)_sources.size();
+        const int stride = count * CMP_MAX;
+
+        _packed.resize((size_t)_width * _height * stride);
+        _packed_memory.set(_packed.size() * sizeof(uint16_t));
+
+        fx::parallel_rows(_height, [&](int first, int last)
+        {
+            for (int y = first; y < last; ++y)
+            {
+                uint16_t* row = _packed.data() + (size_t)y * _width * stride;
+
+                for (int i = 0; i < count; ++i)
+                    quantise_shifted(i, _renderWindow.x1, _renderWindow.y1 + y, _width, row + i * CMP_MAX, stride);
+            }
+        });
+
+        spdlog::debug("[{}] {} sources packed in {}ms", fx::label, count, timer.get());
+    }
+
+    /// Bins of source i at the input depth for size pixels from (x, y), shifted by its alignment
+    /// offset, stride apart. They match what merge_shifted accumulates, edge pixels included.
+    void quantise_shifted(const int i, const int x, const int y, const int size, uint16_t* bins, const int stride)
+    {
+        const fx::point& offset = _offsets[i];
+        const int sy = std::min(std::max(y + offset.y, _bounds.y1), _bounds.y2 - 1);
+        const ptype* src = (ptype*)_sources[i]->getPixelAddress(_bounds.x1, sy);
+        const float scale = (float)(_input_depth - 1);
+
+        for (int p = 0; p < size; ++p, bins += stride)
+        {
+            const int sx = std::min(std::max(x + p + offset.x, _bounds.x1), _bounds.x2 - 1) - _bounds.x1;
+
+            for (int c = 0; c < CMP_MAX; ++c)
+            {
+                const ptype sample = src == nullptr ? 0.f : std::min<ptype>(std::max<ptype>(src[sx * _components + c], 0.f), 1.f);
+                bins[c] = (uint16_t)(sample * scale);
+            }
+        }
+    }
+
+    const uint16_t* packed_pixel(const int x, const int y)
+    {
+        return _packed.data() + window_pixel(x, y) * _sources.size() * CMP_MAX;
+    }
+
+    size_t window_pixel(const int x, const int y)
+    {
+        return (size_t)(y - _renderWindow.y1) * _width + (x - _renderWindow.x1);
+    }
+
+    /// Decides between a full merge and an incremental one against the merge cache of the
+    /// effect. The sums are reusable when the window and tables match; sources are dirty when
+    /// their slot appeared or went away, their exposure time, offset or sampled rows changed,
+    /// or the host reported their clip changed. With at most half the sources dirty, only those are
+    /// re-merged, otherwise the full merge refills the cache. Holds the cache until postProcess.
+    void prepare_cache()
+    {
+        if (_bracket_update == 0 || _deghost || !_packed.empty())
+        {
+            std::unique_lock<std::mutex> lock(_effect.merge_cache_mutex(), std::try_to_lock);
+
+            if (lock.owns_lock() && !_effect.merge_cache().weight.empty())
+            {
+                _effect.merge_cache() = fx::merge_cache();
+                _effect.merge_cache_memory().set(0);
+            }
+
+            return;
+        }
+
+        _cache_lock = std::unique_lock<std::mutex>(_effect.merge_cache_mutex(), std::try_to_lock);
+
+        if (!_cache_lock.owns_lock())
+        {
+            spdlog::debug("[{}] merge cache busy, merging without it", fx::label);
+            return;
+        }
+
+        fx::timer timer;
+        fx::merge_cache& cache = _effect.merge_cache();
+
+        fx::hasher hash;
+        hash.add(_time);
+        hash.add(_renderWindow.x1);
+        hash.add(_renderWindow.y1);
+        hash.add(_width);
+        hash.add(_height);
+        hash.add(_bounds.x1);
+        hash.add(_bounds.y1);
+        hash.add(_bounds.x2);
+        hash.add(_bounds.y2);
+        hash.add(_components);
+        hash.add(_tables.weights);
+        for (int c = 0; c < CMP_MAX; ++c)
+            hash.add(_tables.response[c]);
+
+        const uint64_t key = hash.value();
+
+        /// Only REMERGE_PROBES rows per source are read, spread over the bounds, so finding what
+        /// changed stays a small fraction of a merge. Clip changes come from the host.
+        std::vector<uint64_t> probes(_sources.size() * REMERGE_PROBES);
+
+        fx::parallel_rows((int)probes.size(), [&](int first, int last)
+        {
+            for (int probe = first; probe < last; ++probe)
+                probes[probe] = probe_fingerprint(probe / REMERGE_PROBES, probe % REMERGE_PROBES);
+        });
+
+        _fingerprints.assign(_sources.size(), 0);
+
+        for (int i = 0; i < (int)_sources.size(); ++i)
+        {
+            const fx::point& offset = _offsets[i];
+            _fingerprints[i] = fx::fingerprint(&offset, sizeof(fx::point), 0xcbf29ce484222325ull);
+            _fingerprints[i] = fx::fingerprint(probes.data() + i * REMERGE_PROBES, REMERGE_PROBES * sizeof(uint64_t), _fingerprints[i]);
+        }
+
+        const std::vector<bool> changed = _effect.take_changed_slots();
+
+        _dirty.assign(SRC_MAX, false);
+        int dirty = 0;
+
+        if (cache.valid && cache.key == key)
+        {
+            std::vector<int> index(SRC_MAX, -1);
+            for (int i = 0; i < (int)_sources.size(); ++i)
+                index[_slots[i]] = i;
+
+            for (int slot = 0; slot < SRC_MAX; ++slot)
+            {
+                const int i = index[slot];
+
+                if (i < 0)
+                    _dirty[slot] = cache.present[slot];
+                else
+                    _dirty[slot] = !cache.present[slot] ||
+                                   changed[slot] ||
+                                   cache.exp_time_log[slot] != _exp_times_log[i] ||
+                                   cache.fingerprints[slot] != _fingerprints[i];
+
+                dirty += _dirty[slot];
+            }
+        }
+        else
+            dirty = SRC_MAX;
+
+        if (dirty * 2 <= (int)_sources.size())
+        {
+            _remerge = true;
+            _darkest_changed = cache.darkest != _slots[_darkest];
+
+            for (int i = 0; i < (int)_sources.size(); ++i)
+                if (_dirty[_slots[i]])
+                    cache.bins[_slots[i]].resize((size_t)_width * _height * CMP_MAX);
+
+            spdlog::debug("[{}] {} of {} sources re-merged from cache, prepared in {}ms", fx::label, dirty, _sources.size(), timer.get());
+            return;
+        }
+
+        _fill_cache = true;
+        cache.reset(key, _width * _height);
+
+        for (int i = 0; i < (int)_sources.size(); ++i)
+            cache.bins[_slots[i]].resize((size_t)_width * _height * CMP_MAX);
+
+        spdlog::debug("[{}] merge cache refilled by a full merge", fx::label);
+    }
+
+    /// Hash of the middle row of band probe of source i, one of REMERGE_PROBES bands of the bounds.
+    uint64_t probe_fingerprint(const int i, const int probe)
+    {
+        const int y = _bounds.y1 + (int)((int64_t)(_bounds.y2 - _bounds.y1) * (2 * probe + 1) / (2 * REMERGE_PROBES));
+        const void* row = _sources[i]->getPixelAddress(_bounds.x1, y);
+
+        if (row == nullptr)
+            return 0;
+
+        return fx::fingerprint(row, (size_t)(_bounds.x2 - _bounds.x1) * _components * sizeof(ptype), 0xcbf29ce484222325ull);
+    }
+
+    /// Stores a fully merged block row and the bins of every source in the merge cache.
+    void fill_cache(const int x, const int y, const fx::merge_block& block)
+    {
+        fx::merge_cache& cache = _effect.merge_cache();
+        const size_t first = window_pixel(x, y);
+
+        cache.store(first, block);
+
+        for (int i = 0; i < (int)_sources.size(); ++i)
+            quantise_shifted(i, x, y, block.size, cache.bins[_slots[i]].data() + first * CMP_MAX, CMP_MAX);
+    }
+
+    /// Incremental merge of a block row: the cached sums lose the old contribution of every
+    /// dirty slot and gain the new one, and the fallback follows the darkest source.
+    void remerge(const int x, const int y, fx::merge_block& block, fx::merge_block& scratch)
+    {
+        fx::merge_cache& cache = _effect.merge_cache();
+        const size_t first = window_pixel(x, y);
+
+        cache.load(first, block);
+
+        for (int slot = 0; slot < SRC_MAX; ++slot)
+        {
+            if (_dirty[slot] && cache.present[slot])
+                fx::merge_remove(_tables, cache.bins[slot].data() + first * CMP_MAX, cache.exp_time_log[slot], block);
+        }
+
+        for (int i = 0; i < (int)_sources.size(); ++i)
+        {
+            if (!_dirty[_slots[i]])
+                continue;
+
+            merge_shifted(i, x, y, block, 1.f);
+            quantise_shifted(i, x, y, block.size, cache.bins[_slots[i]].data() + first * CMP_MAX, CMP_MAX);
+        }
+
+        if (_darkest_changed && !_dirty[_slots[_darkest]])
+        {
+            scratch.clear(block.size);
+            merge_shifted(_darkest, x, y, scratch, 1.f);
+            std::copy(&scratch.fallback[0][0], &scratch.fallback[0][0] + block.size * CMP_MAX, &block.fallback[0][0]);
+        }
+
+        cache.store(first, block);
+    }
+
+    /// Records the sources the cached sums now hold and releases the cache. An aborted
+    /// render leaves partial sums, which the next render replaces with a full merge.
+    void finish_cache()
+    {
+        if (!_cache_lock.owns_lock())
+            return;
+
+        fx::merge_cache& cache = _effect.merge_cache();
+
+        if (_fill_cache || _remerge)
+        {
+            std::vector<bool> present(SRC_MAX, false);
+
+            for (int i = 0; i < (int)_sources.size(); ++i)
+            {
+                const int slot = _slots[i];
+                present[slot] = true;
+                cache.exp_time_log[slot] = _exp_times_log[i];
+                cache.fingerprints[slot] = _fingerprints[i];
+            }
+
+            for (int slot = 0; slot < SRC_MAX; ++slot)
+            {
+                if (!present[slot])
+                    std::vector<uint16_t>().swap(cache.bins[slot]);
+            }
+
+            cache.present = present;
+            cache.darkest = _slots[_darkest];
+            cache.valid = !_effect.abort();
+        }
+
+        _effect.merge_cache_memory().set(cache.bytes());
+
+        _cache_lock.unlock();
+    }
+
+    /// Pass 2 alternative: local tone mapping (Durand, Dorsey 2002). Log2 luminance is split
+    /// into a base layer by an edge preserving bilateral filter and a detail layer; only the
+    /// base is compressed to the base range in stops, so local contrast survives.
+    ///   B = bilateral(log2 L), D = log2 L - B
+    ///   L_d = 2^((B - B_max) * min(1, range / (B_max - B_min)) + D * detail)
+    /// The filter runs on a bilateral grid of about 2% of the image size by 1.33 stops.
+    void local_tone_map(ptype* dst, const float pixel_scale)
+    {
+        const int count = pixel_size() / _components;
+        std::vector<float> log_lum(count);
+        std::vector<float> base;
+
+        fx::parallel_rows(_height, [&](int first, int last)
+        {
+            for (int i = first * _width; i < last * _width; ++i)
+            {
+                ptype* pixel = dst + (size_t)i * _components;
+
+                for (int c = 0; c < CMP_MAX; ++c)
+                    pixel[c] *= pixel_scale;
+
+                /// Clamped to the float range, so a NaN or inf from the merge cannot stretch the grid.
+                const float lum = luminance(pixel);
+                log_lum[i] = lum > 1e-6f ? std::log2(std::min(lum, FLT_MAX)) : std::log2(1e-6f);
+            }
+        });
+
+        fx::bilateral_grid grid(0.02f * std::max(_width, _height), 1.33f);
+        grid.filter(log_lum, _width, _height, base);
+
+        const float base_min = *std::min_element(base.begin(), base.end());
+        const float base_max = *std::max_element(base.begin(), base.end());
+        const float compression = base_max > base_min ? std::min(1.f, _base_range / (base_max - base_min)) : 1.f;
+
+        fx::parallel_rows(_height, [&](int first, int last)
+        {
+            for (int i = first * _width; i < last * _width; ++i)
+            {
+                ptype* pixel = dst + (size_t)i * _components;
+
+                const float lum = luminance(pixel);
+                if (lum <= 0.f)
+                    continue;
+
+                const float lum_tone = std::exp2((base[i] - base_max) * compression + (log_lum[i] - base[i]) * _detail);
 
                 for (int c = 0; c < CMP_MAX; ++c)
                 {
-                    const float log_hdr = weight_sum > 0.f
-                        ? result[c] / weight_sum
-                        : fallback_log[c];
-                    const float hdr = std::exp(log_hdr);
-                    dst[c] = (ptype)pow(hdr, 1.f / _gamma);
+                    const float tone = lum_tone * pixel[c] / lum;
+                    pixel[c] = tone + (pixel[c] - tone) * _highlights;
                 }
+            }
+        });
+    }
+
+    /// Exposure fusion of the aligned sources straight into the destination, replacing
+    /// merge and tone mapping. Sources are read through their offsets like the merge.
+    void fuse()
+    {
+        const int width = _bounds.x2 - _bounds.x1;
+        const int height = _bounds.y2 - _bounds.y1;
+
+        fx::fusion fusion(width, height, _fusion_contrast, _fusion_saturation, _fusion_exposedness);
+
+        auto read = [&](int i, int y, float* row)
+        {
+            const fx::point& offset = _offsets[i];
+            const int sy = std::min(std::max(_bounds.y1 + y + offset.y, _bounds.y1), _bounds.y2 - 1);
+            const ptype* src = (ptype*)_sources[i]->getPixelAddress(_bounds.x1, sy);
+
+            for (int x = 0; x < width; ++x)
+            {
+                const int sx = std::min(std::max(x + offset.x, 0), width - 1);
+
+                for (int c = 0; c < CMP_MAX; ++c)
+                    row[x * CMP_MAX + c] = src == nullptr ? 0.f : std::min(std::max((float)src[sx * _components + c], 0.f), 1.f);
+            }
+        };
+
+        if (!fusion.run((int)_sources.size(), read, [&]() { return _effect.abort(); }))
+            return;
+
+        for (int y = 0; y < height; ++y)
+        {
+            const float* pixel = fusion.result().row(y);
+            ptype* dst = (ptype*)_dstImg->getPixelAddress(_bounds.x1, _bounds.y1 + y);
 
-                if(_show_samples && _effect.sample_set().count(fx::point(x, y).key()))
-                    dst[fx::ch::g] = FLT_MAX;
+            for (int x = 0; dst != nullptr && x < width; ++x, dst += _components, pixel += CMP_MAX)
+            {
+                for (int c = 0; c < CMP_MAX; ++c)
+                    dst[c] = std::min(std::max(pixel[c], 0.f), 1.f);
 
                 dst[fx::ch::a] = 1.0f;
             }
         }
+
+        spdlog::info("[{}] {} sources fused in {}ms", fx::label, _sources.size(), _timer.get());
+    }
+
+    /// Alignment offsets of the sources, from the effect cache when aligned for this frame,
+    /// otherwise aligned now and cached.
+    void align_sources()
+    {
+        if (!_align)
+            _offsets.assign(_sources.size(), fx::point(0, 0));
+        else if (!_effect.cached_offsets(_time, _offsets) || _offsets.size() != _sources.size())
+        {
+            _offsets = align();
+            _effect.cache_offsets(_time, _offsets);
+        }
+    }
+
+    /// Finds the integer translation of every source against the middle exposure with
+    /// median threshold bitmaps.
+    std::vector<fx::point> align()
+    {
+        const std::vector<std::shared_ptr<OFX::Image>>& sources = _sources;
+
+        fx::timer timer;
+
+        int levels = 1;
+        while ((1 << levels) - 1 < _align_shift)
+            ++levels;
+
+        std::vector<std::vector<fx::mtb_level>> pyramids(sources.size());
+
+        fx::parallel_rows((int)sources.size(), [&](int first, int last)
+        {
+            for (int i = first; i < last; ++i)
+            {
+                std::vector<uint8_t> gray((size_t)(_bounds.x2 - _bounds.x1) * (_bounds.y2 - _bounds.y1));
+
+                for (int y = _bounds.y1; y < _bounds.y2; ++y)
+                {
+                    const ptype* src = (ptype*)sources[i]->getPixelAddress(_bounds.x1, y);
+                    uint8_t* row = gray.data() + (size_t)(y - _bounds.y1) * (_bounds.x2 - _bounds.x1);
+
+                    for (int x = 0; src != nullptr && x < _bounds.x2 - _bounds.x1; ++x, src += _components)
+                    {
+                        const float lum = luminance((float*)src);
+                        row[x] = (uint8_t)(std::min(std::max(lum, 0.f), 1.f) * 255.f + 0.5f);
+                    }
+                }
+
+                pyramids[i] = fx::mtb_pyramid(std::move(gray), _bounds.x2 - _bounds.x1, _bounds.y2 - _bounds.y1, levels);
+            }
+        });
+
+        const int reference = middle_exposure();
+
+        std::vector<fx::point> offsets(sources.size(), fx::point(0, 0));
+
+        for (int i = 0; i < (int)sources.size(); ++i)
+        {
+            if (i != reference)
+                offsets[i] = fx::mtb_offset(pyramids[reference], pyramids[i]);
+
+            spdlog::debug("[{}] source {} offset ({}, {})", fx::label, i + 1, offsets[i].x, offsets[i].y);
+        }
+
+        spdlog::info("[{}] {} sources aligned in {}ms", fx::label, sources.size(), timer.get());
+
+        return offsets;
+    }
+
+    /// The middle exposure has the most pixels away from the median in both directions,
+    /// which makes it the reference for alignment and deghosting.
+    int middle_exposure()
+    {
+        std::vector<int> order(_sources.size());
+        for (int i = 0; i < (int)order.size(); ++i)
+            order[i] = i;
+
+        std::sort(order.begin(), order.end(), [&](int a, int b) { return _exp_times[a] < _exp_times[b]; });
+        return order[order.size() / 2];
+    }
+
+    /// Sparse overlay pass, touches only the sample points inside the processing window
+    /// instead of probing every output pixel.
+    void draw_samples(const OfxRectI& proc_window)
+    {
+        for (const fx::point& point : _effect.sample_points())
+        {
+            if (point.x < proc_window.x1 || point.x >= proc_window.x2 ||
+                point.y < proc_window.y1 || point.y >= proc_window.y2)
+                continue;
+
+            ptype* dst = (ptype*)_dstImg->getPixelAddress(point.x, point.y);
+
+            if (dst != nullptr)
+                dst[fx::ch::g] = FLT_MAX;
+        }
     }
 
     virtual void postProcess() 
     {
         if (_sources.empty()) return;
 
+        finish_cache();
+
+        if (_fusion)
+        {
+            fuse();
+            return;
+        }
+
         ptype* dst = (ptype*)_dstImg->getPixelData();
 
         /// Pass 1: scene maximum (always needed for Reinhard) and, when middle gray is enabled, 
@@ -185,30 +800,43 @@ public:
         const float scaled_lum_max = _luminance_max * pixel_scale;
         const float log_lum_max = std::log10(1.f + scaled_lum_max);
 
-        /// Pass 2: Reinhard global tone mapping
-        /// highlights blends between fully tone-mapped (0) and linear (1)
-        ///   L_d = log10(1 + L_scaled) / log10(1 + L_max_scaled)  [display luminance]
-        ///   C_d = L_d * C / L  [per-channel, preserves hue]
-        for (int i = 0; i < pixel_size(); i += _components)
+        if (_local_tone_mapping)
         {
-            for (int c = 0; c < CMP_MAX; ++c)
-                dst[i + c] *= pixel_scale;
+            local_tone_map(dst, pixel_scale);
+        }
+        else
+        {
+            /// Pass 2: Reinhard global tone mapping
+            /// highlights blends between fully tone-mapped (0) and linear (1)
+            ///   L_d = log10(1 + L_scaled) / log10(1 + L_max_scaled)  [display luminance]
+            ///   C_d = L_d * C / L  [per-channel, preserves hue]
+            for (int i = 0; i < pixel_size(); i += _components)
+            {
+                for (int c = 0; c < CMP_MAX; ++c)
+                    dst[i + c] *= pixel_scale;
 
-            const float lum = luminance(dst + i);
-            if (lum == 0.f || scaled_lum_max == 0.f)
-                continue;
+                const float lum = luminance(dst + i);
+                if (lum == 0.f || scaled_lum_max == 0.f)
+                    continue;
 
-            const float lum_dif = std::log10(1.f + lum) / log_lum_max;
+                const float lum_dif = std::log10(1.f + lum) / log_lum_max;
 
-            for (int c = 0; c < CMP_MAX; ++c)
-            {
-                const float tone = lum_dif * dst[i + c] / lum;
-                dst[i + c] = tone + (dst[i + c] - tone) * _highlights;
+                for (int c = 0; c < CMP_MAX; ++c)
+                {
+                    const float tone = lum_dif * dst[i + c] / lum;
+                    dst[i + c] = tone + (dst[i + c] - tone) * _highlights;
+                }
             }
         }
 
+        /// Drawn over the tone mapped result, so the markers stay out of its statistics.
+        if (_show_samples)
+            draw_samples(_renderWindow);
+
         if(!_effect.abort() && !_sources.empty())
             spdlog::info("[{}] {} sources merged in {}ms", fx::label, _sources.size(), _timer.get());
+
+        fx::memory_ledger::instance().report();
     }
 
     void set_parameters(const double& time)
@@ -217,133 +845,264 @@ public:
         _gamma = _effect.gamma(time);
         _highlights = _effect.highlights(time);
         _calibrate = _effect.calibrate(time);
+        _use_linear = !_calibrate;
+        _async_calibration = _effect.async_calibration(time);
+        _use_profile = _effect.use_profile(time);
+        _profile_file = _effect.profile_file(time);
         _show_samples = _effect.show_samples(time);
         _samples = _effect.samples(time);
         _solver_type = _effect.solver_type(time);
         _smoothness = _effect.smoothness(time);
+        _calibration_budget = _effect.calibration_budget(time);
+        _share_calibration = _effect.share_calibration(time);
+        _target_coverage = _effect.target_coverage(time);
         _input_depth = _effect.input_depth(time);
         _use_middle_gray = _effect.use_middle_gray(time);
         _middle_gray = _effect.middle_gray(time);
+        _local_tone_mapping = _effect.local_tone_mapping(time);
+        _base_range = _effect.base_range(time);
+        _detail = _effect.detail(time);
+        _fusion = _effect.fusion(time);
+        _fusion_contrast = _effect.fusion_contrast(time);
+        _fusion_saturation = _effect.fusion_saturation(time);
+        _fusion_exposedness = _effect.fusion_exposedness(time);
+        _align = _effect.align(time);
+        _align_shift = _effect.align_shift(time);
+        _deghost = _effect.deghost(time);
+        _deghost_threshold = _effect.deghost_threshold(time);
+        _pack_sources = _effect.pack_sources(time);
+        _bracket_update = _effect.bracket_update(time);
+        _memory_budget = _effect.memory_budget(time);
+        _time = time;
     }
 
     void calibrate()
     {   
         _effect.set_regen_calib(false);
-        _effect.sample_points().clear();
-        _effect.sample_set().clear();
 
-        const float aspect = (float)_width / (float)_height;
-        
-        const int actual_samples = (_solver_type == 0) ? _samples : _samples * 100;
-        const int x_points = std::max(1, (int)(sqrt(aspect * actual_samples)));
-        const int y_points = std::max(1, actual_samples / x_points);
+        select_samples();
+
+        const sample_bins bins = gather_samples();
+        fx::memory_scope sample_memory(fx::memory_ledger::instance().samples, bins.data().size() * sizeof(uint16_t));
+
+        int concurrency;
+        const int solver_type = budget_solver(bins, concurrency);
 
-        const int step_x = std::max(1, _width / x_points);
-        const int step_y = std::max(1, _height / y_points);
+        /// The solve writes over the current curve, which the iterative solver starts from.
+        const std::vector<double> initial = previous_response();
 
-        for (int i = 0, x = step_x / 2; i < x_points; i++, x += step_x)
+        /// Host aborts are forwarded to the solvers from the render thread, which
+        /// also drives the host progress bar while the channels solve.
+        fx::cancel_token cancel;
+        _effect.progressStart("Calibrating response");
+
+        const std::function<bool(double*)> solve = [&](double* response)
         {
-            for (int j = 0, y = step_y / 2; j < y_points; j++, y += step_y)
+            return solve_response(_calibration_budget,
+                                  _target_coverage,
+                                  solver_type,
+                                  _input_depth,
+                                  _smoothness,
+                                  bins,
+                                  _exp_times,
+                                  _exp_times_log,
+                                  _effect.input_weights(),
+                                  initial.empty() ? nullptr : initial.data(),
+                                  response,
+                                  cancel,
+                                  [&](double value)
             {
-                if (0 <= x && x < _width && 0 <= y && y < _height)
-                {
-                    _effect.sample_points().push_back(fx::point(x, y));
-                    _effect.sample_set().insert(fx::point(x, y).key());
-                    spdlog::debug("{}: Getting sample pos({}, {})", fx::label, x, y);
-                }
-            }
+                if (_effect.abort())
+                    cancel.cancel();
+
+                _effect.progressUpdate(value);
+            },
+                                  concurrency,
+                                  (size_t)_memory_budget << 20);
+        };
+
+        const bool solved = _share_calibration == 0
+            ? solve(_effect.response(_input_depth, 0))
+            : fx::shared_solve(calibration_key(bins), _input_depth, _effect.response(_input_depth, 0), [&]()
+            {
+                if (_effect.abort())
+                    cancel.cancel();
+
+                return cancel.cancelled();
+            }, solve);
+
+        _effect.progressEnd();
+
+        if (solved)
+            _effect.set_calibrated_depth(_input_depth);
+        else
+        {
+            spdlog::debug("[{}] calibration cancelled", fx::label);
+            _effect.set_regen_calib(true);
         }
-        
-        std::thread threads[CMP_MAX];
+    }
 
-        for (int c = 0; c < CMP_MAX; ++c)
+    /// Starts a background solve when the curve is out of date and keeps rendering with
+    /// the previous curve, or with the linear response if none matches the input depth.
+    void calibrate_async()
+    {
+        if (_effect.adopt_calibration())
+            spdlog::debug("[{}] background calibration adopted", fx::label);
+
+        if (_effect.regen_calib() && !_effect.calibration_running())
         {
-            if (_solver_type == 0)
-            {
-                threads[c] = std::thread(debevec_solver<ptype, OFX::Image>, c,
-                                                        _input_depth,
-                                                        _smoothness,
-                                                        _sources,
-                                                        _effect.sample_points(),
-                                                        _exp_times_log,
-                                                        _effect.input_weights(),
-                                                        _effect.response(_input_depth, c));
-            }
-            else if (_solver_type == 1)
+            _effect.set_regen_calib(false);
+
+            select_samples();
+
+            const sample_bins bins = gather_samples();
+
+            int concurrency;
+            const int solver_type = budget_solver(bins, concurrency);
+            const int input_depth = _input_depth;
+            const float smoothness = _smoothness;
+            const int budget = _calibration_budget;
+            const float target_coverage = _target_coverage;
+            const size_t memory_budget = (size_t)_memory_budget << 20;
+            const std::vector<float> exp_times = _exp_times;
+            const std::vector<float> exp_times_log = _exp_times_log;
+            const std::vector<float> input_weights = _effect.input_weights();
+            const std::vector<double> initial = previous_response();
+            const bool share = _share_calibration != 0;
+            const uint64_t key = calibration_key(bins);
+
+            _effect.start_calibration(input_depth, [=](std::vector<double>& response, const fx::cancel_token& cancel)
             {
-                threads[c] = std::thread(robertson_solver<ptype, OFX::Image>, c,
-                                                        _input_depth,
-                                                        (int)_smoothness,
-                                                        _sources,
-                                                        _effect.sample_points(),
-                                                        _exp_times,
-                                                        _effect.input_weights(),
-                                                        _effect.response(_input_depth, c));
-            }
+                fx::timer timer;
+                fx::memory_scope sample_memory(fx::memory_ledger::instance().samples, bins.data().size() * sizeof(uint16_t));
+                response.resize(input_depth * CMP_MAX);
+
+                const std::function<bool(double*)> solve = [&](double* curves)
+                {
+                    return solve_response(budget,
+                                          target_coverage,
+                                          solver_type,
+                                          input_depth,
+                                          smoothness,
+                                          bins,
+                                          exp_times,
+                                          exp_times_log,
+                                          input_weights,
+                                          initial.empty() ? nullptr : initial.data(),
+                                          curves,
+                                          cancel,
+                                          nullptr,
+                                          concurrency,
+                                          memory_budget);
+                };
+
+                const bool solved = share
+                    ? fx::shared_solve(key, input_depth, response.data(), [&]() { return cancel.cancelled(); }, solve)
+                    : solve(response.data());
+
+                if (solved)
+                    spdlog::info("[{}] background calibration finished in {}ms", fx::label, timer.get());
+
+                return solved;
+            });
         }
 
-        for (int c = 0; c < CMP_MAX; ++c)
-            threads[c].join();
+        if (!_effect.calibrated(_input_depth))
+        {
+            _use_linear = true;
+            linear_response();
+        }
+    }
+
+    /// Copy of the last solved or loaded curves at the input depth, empty when there are none.
+    std::vector<double> previous_response()
+    {
+        if (!_effect.calibrated(_input_depth))
+            return std::vector<double>();
 
-        if (_solver_type == 1)
-            average_robertson_curves();
+        const double* response = _effect.response(_input_depth, 0);
+        return std::vector<double>(response, response + _input_depth * CMP_MAX);
     }
 
     void calibrate_linear()
     {
         _effect.set_regen_calib(false);
+        linear_response();
+    }
 
+    void linear_response()
+    {
         for (int i = 0; i < _input_depth; ++i)
             _effect.response_linear()[i] = std::log(i * (1.f / _input_depth));
 
         _effect.response_linear()[0] = _effect.response_linear()[1];
     }
 
-    void average_robertson_curves()
+    /// Reads every sample point of every aligned source once, into the bins all channels and
+    /// solvers share. Host images must not outlive the render, the bins are all a solve needs.
+    sample_bins gather_samples()
     {
-        /// Robertson runs per-channel independently, producing divergent curve shapes
-        /// on sparse linear data. Average them into one shared curve to eliminate tints,
-        /// then smooth to remove kinks from sparsely-sampled bins near highlights.
-        for (int m = 0; m < _input_depth; ++m)
+        const std::vector<fx::point>& points = _effect.sample_points();
+        sample_bins bins((int)_sources.size(), (int)points.size(), _input_depth);
+
+        if (!_packed.empty())
         {
-            double avg = 0.0;
-            for (int c = 0; c < CMP_MAX; ++c)
-                avg += _effect.response(_input_depth, c)[m];
-            avg /= CMP_MAX;
-            for (int c = 0; c < CMP_MAX; ++c)
-                _effect.response(_input_depth, c)[m] = avg;
-        }
+            // Sample points are image coordinates, the packed buffer starts at the window origin.
+            std::vector<fx::point> window;
+            for (const fx::point& point : points)
+                window.push_back(fx::point(point.x - _renderWindow.x1, point.y - _renderWindow.y1));
 
-        /// 3 passes of box-filter smoothing approximates a Gaussian kernel,
-        /// handling broader plateau-type banding from sparsely-sampled highlight bins.
-        const int radius = 4;
-        const int passes = 3;
-        std::vector<double> smoothed(_input_depth);
-        for (int pass = 0; pass < passes; ++pass)
+            for (int i = 0; i < (int)_sources.size(); ++i)
+                bins.gather(i, _packed.data() + i * CMP_MAX, _width, _height, (int)_sources.size() * CMP_MAX, window);
+        }
+        else
         {
-            double* curve = _effect.response(_input_depth, 0);
-            for (int m = 0; m < _input_depth; ++m)
-            {
-                double sum = 0.0;
-                int count = 0;
-                for (int k = std::max(0, m - radius); k <= std::min(_input_depth - 1, m + radius); ++k)
-                {
-                    sum += curve[k];
-                    ++count;
-                }
-                smoothed[m] = sum / count;
-            }
-            for (int m = 0; m < _input_depth; ++m)
-                for (int c = 0; c < CMP_MAX; ++c)
-                    _effect.response(_input_depth, c)[m] = smoothed[m];
+            for (int i = 0; i < (int)_sources.size(); ++i)
+                bins.gather<ptype>(i, *_sources[i], points, _offsets[i]);
         }
+
+        return bins;
     }
 
-    inline float lookup_response(int bin, int channel) const
+    /// Identifies a calibration across node instances by the solver settings and exposures,
+    /// plus the sampled bins unless sharing by settings alone, as between stereo views.
+    uint64_t calibration_key(const sample_bins& bins)
     {
-        return _calibrate
-            ? (float)_effect.response(_input_depth, channel)[bin]
-            : (float)_effect.response_linear()[bin];
+        fx::hasher hash;
+        hash.add(_share_calibration);
+        hash.add(_solver_type);
+        hash.add(_input_depth);
+        hash.add(_smoothness);
+        hash.add(_samples);
+        hash.add(_calibration_budget);
+        hash.add(_target_coverage);
+        hash.add(_memory_budget);
+        hash.add(_width);
+        hash.add(_height);
+        hash.add(_exp_times);
+
+        if (_share_calibration == 1)
+            hash.add(bins.data());
+
+        return hash.value();
+    }
+
+    /// Solver and channel concurrency within the memory budget for these samples.
+    int budget_solver(const sample_bins& bins, int& concurrency)
+    {
+        return fit_solver((size_t)_memory_budget << 20, _solver_type, _input_depth, bins.samples(), bins.sources(), concurrency);
+    }
+
+    /// Grid over the render window, in image coordinates like the sources and the overlay.
+    void select_samples()
+    {
+        _effect.sample_points() = sample_grid(_width, _height, _samples, _solver_type);
+
+        for (fx::point& point : _effect.sample_points())
+            point = fx::point(point.x + _renderWindow.x1, point.y + _renderWindow.y1);
+
+        for (const fx::point& point : _effect.sample_points())
+            spdlog::debug("{}: Getting sample pos({}, {})", fx::label, point.x, point.y);
     }
 
     inline float luminance(float* rgb)
@@ -352,9 +1111,10 @@ public:
     }
 
     int pixel_size() { return _width * _height * _components; }
-    void add_source(std::shared_ptr<OFX::Image> src_image) { _sources.push_back(src_image); }
+    void add_source(const int slot, std::shared_ptr<OFX::Image> src_image) { _slots.push_back(slot); _sources.push_back(src_image); }
     void add_exp_time(float val) { _exp_times.push_back(val); _exp_times_log.push_back(std::log(val)); }
     void set_resolution(const OfxRectI& window) { _width = window.x2 - window.x1; _height = window.y2 - window.y1; }
+    void set_bounds(const OfxRectI& bounds) { _bounds = bounds; }
     void set_response() { _effect.set_response_size(CMP_MAX, _input_depth); }
     void set_linear_response() { _effect.set_response_linear_size(_input_depth); }
     
@@ -362,26 +1122,64 @@ private:
     int _width = 0;
     int _height = 0;
     int _components = 0;
+    double _time = 0;
+    OfxRectI _bounds = { 0, 0, 0, 0 };
 
     fx::timer _timer;
 
     std::vector<float> _exp_times;
     std::vector<float> _exp_times_log;
     std::vector<std::shared_ptr<OFX::Image>> _sources;
+    std::vector<int> _slots;
+    std::vector<fx::point> _offsets;
+
+    fx::merge_tables _tables;
+    std::vector<uint16_t> _packed;
+    fx::memory_scope _packed_memory{ fx::memory_ledger::instance().images };
+    int _darkest = 0;
+    int _reference = 0;
+
+    std::unique_lock<std::mutex> _cache_lock;
+    std::vector<uint64_t> _fingerprints;
+    std::vector<bool> _dirty;
+    bool _fill_cache = false;
+    bool _remerge = false;
+    bool _darkest_changed = false;
 
     float _exposure = 0;
     float _gamma = 0;
     float _highlights = 0;
     bool _calibrate = false;
+    bool _use_linear = true;
+    bool _async_calibration = false;
+    bool _use_profile = false;
+    std::string _profile_file;
     bool _show_samples = false;
+    bool _local_tone_mapping = false;
+    float _base_range = 0;
+    float _detail = 0;
+    bool _fusion = false;
+    float _fusion_contrast = 1;
+    float _fusion_saturation = 1;
+    float _fusion_exposedness = 1;
     int _samples = 0;
     int _solver_type = 0;
+    int _share_calibration = 0;
     float _smoothness = 0;
+    int _calibration_budget = 0;
+    float _target_coverage = 0;
     int _input_depth = 0;
 
     float _luminance_max = 0;
     bool _use_middle_gray = false;
     float _middle_gray = 0;
+    bool _align = false;
+    int _align_shift = 0;
+    bool _deghost = false;
+    float _deghost_threshold = 0;
+    bool _pack_sources = false;
+    int _bracket_update = 0;
+    int _memory_budget = 0;
 
     Effect<ptype>& _effect;
 };
@@ -0,0 +1,176 @@
+//
+//  profile.h
+//  MakeHDR
+//
+//  Created by Vahan Sosoyan 2024.
+//
+
+#ifndef profile_h
+#define profile_h
+
+#include "resources.h"
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#define PROFILE_VERSION 1
+#define PROFILE_MAX_DEPTH 65536
+
+
+namespace fx
+{
+    /// Solved camera response curves with the settings they came from, stored as a small
+    /// versioned text file so a camera body is calibrated once and reused across scripts.
+    ///
+    ///     make_hdr_profile 1
+    ///     camera <identifier>
+    ///     depth 256
+    ///     solver 0
+    ///     samples 100
+    ///     smoothness 50
+    ///     curve 0 <depth values>
+    ///     curve 1 <depth values>
+    ///     curve 2 <depth values>
+    struct profile
+    {
+    public:
+        bool save(const std::string& path) const
+        {
+            std::ofstream file(path);
+
+            if (!file)
+                return false;
+
+            file << "make_hdr_profile " << PROFILE_VERSION << "\n";
+            file << "camera " << camera << "\n";
+            file << "depth " << depth << "\n";
+            file << "solver " << solver << "\n";
+            file << "samples " << samples << "\n";
+            file << "smoothness " << smoothness << "\n";
+            file << std::setprecision(17);
+
+            for (int c = 0; c < CMP_MAX; ++c)
+            {
+                file << "curve " << c;
+
+                for (int i = 0; i < depth; ++i)
+                    file << " " << response[depth * c + i];
+
+                file << "\n";
+            }
+
+            return (bool)file;
+        }
+
+        bool load(const std::string& path)
+        {
+            std::ifstream file(path);
+            std::string line;
+            std::string key;
+            int version = 0;
+            bool curves[CMP_MAX] = {};
+
+            if (!file || !(file >> key >> version) || key != "make_hdr_profile")
+                return false;
+
+            if (version > PROFILE_VERSION)
+            {
+                spdlog::error("[{}] profile {} has unsupported version {}", label, path, version);
+                return false;
+            }
+
+            std::getline(file, line);
+
+            while (std::getline(file, line))
+            {
+                std::istringstream stream(line);
+
+                if (!(stream >> key))
+                    continue;
+
+                if (key == "camera")
+                {
+                    std::getline(stream >> std::ws, camera);
+                }
+                else if (key == "depth")
+                {
+                    depth = 0;
+
+                    if (!(stream >> depth) || depth < 2 || depth > PROFILE_MAX_DEPTH)
+                    {
+                        spdlog::error("[{}] profile {} has invalid depth {}", label, path, depth);
+                        return false;
+                    }
+
+                    response.assign(depth * CMP_MAX, 0.0);
+                    std::fill(curves, curves + CMP_MAX, false);
+                }
+                else if (key == "solver")
+                    stream >> solver;
+                else if (key == "samples")
+                    stream >> samples;
+                else if (key == "smoothness")
+                    stream >> smoothness;
+                else if (key == "curve")
+                {
+                    int c = -1;
+                    stream >> c;
+
+                    if (c < 0 || c >= CMP_MAX || depth < 2 || curves[c])
+                    {
+                        spdlog::error("[{}] profile {} has an unexpected or repeated curve {}", label, path, c);
+                        return false;
+                    }
+
+                    for (int i = 0; i < depth; ++i)
+                    {
+                        if (!(stream >> response[depth * c + i]))
+                            return false;
+                    }
+
+                    curves[c] = true;
+                }
+            }
+
+            for (int c = 0; c < CMP_MAX; ++c)
+            {
+                if (!curves[c])
+                {
+                    spdlog::error("[{}] profile {} is missing curve {}", label, path, c);
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        /// Linearly resamples the curves to another bin count, preserving the normalised
+        /// code value each bin represents.
+        void resample(const int target_depth, double* target) const
+        {
+            for (int c = 0; c < CMP_MAX; ++c)
+            {
+                const double* curve = response.data() + depth * c;
+
+                for (int i = 0; i < target_depth; ++i)
+                {
+                    const double position = (double)i * (depth - 1) / (target_depth - 1);
+                    const int lower = std::min((int)position, depth - 2);
+                    const double t = position - lower;
+
+                    target[target_depth * c + i] = curve[lower] + t * (curve[lower + 1] - curve[lower]);
+                }
+            }
+        }
+
+        std::string camera;
+        int depth = 0;
+        int solver = 0;
+        int samples = 0;
+        float smoothness = 0;
+        std::vector<double> response;
+    };
+}
+
+#endif
@@ -0,0 +1,226 @@
+//
+//  registry.h
+//  MakeHDR
+//
+//  Created by Vahan Sosoyan 2024.
+//
+
+#ifndef registry_h
+#define registry_h
+
+#include "resources.h"
+
+#include <list>
+#include <unordered_map>
+#include <condition_variable>
+
+#define REGISTRY_MAX_BYTES (64 << 20)
+
+
+namespace fx
+{
+    /// FNV-1a over the raw bytes of whatever is added.
+    class hasher
+    {
+    public:
+        void add(const void* data, const size_t size)
+        {
+            const unsigned char* bytes = (const unsigned char*)data;
+
+            for (size_t i = 0; i < size; ++i)
+                _value = (_value ^ bytes[i]) * 1099511628211ull;
+        }
+
+        template<typename T>
+        void add(const T& value) { add(&value, sizeof(T)); }
+
+        template<typename T>
+        void add(const std::vector<T>& values) { add(values.data(), values.size() * sizeof(T)); }
+
+        uint64_t value() const { return _value; }
+
+    private:
+        uint64_t _value = 14695981039346656037ull;
+    };
+
+    /// One solve shared between node instances. Pending until the instance that created it
+    /// publishes the curves, or gives up, after which the next instance asking solves instead.
+    struct calibration_entry
+    {
+        uint64_t key = 0;
+        int depth = 0;
+        bool ready = false;
+        bool failed = false;
+        std::vector<double> response;
+    };
+
+    /// Process wide calibration results, keyed by a hash of the sources and solver settings.
+    /// Entries are reference counted, so waiting instances keep theirs alive, and published
+    /// ones are dropped least recently used first beyond REGISTRY_MAX_BYTES.
+    class calibration_registry
+    {
+    public:
+        static calibration_registry& instance()
+        {
+            static calibration_registry registry;
+            return registry;
+        }
+
+        /// Returns the entry for key, creating a pending one owned by the caller when missing.
+        std::shared_ptr<calibration_entry> acquire(const uint64_t key, bool& owner)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto found = _index.find(key);
+
+            if (found != _index.end())
+            {
+                _lru.splice(_lru.begin(), _lru, found->second);
+                owner = false;
+                return *found->second;
+            }
+
+            std::shared_ptr<calibration_entry> entry = std::make_shared<calibration_entry>();
+            entry->key = key;
+
+            _lru.push_front(entry);
+            _index[key] = _lru.begin();
+            owner = true;
+
+            return entry;
+        }
+
+        void publish(const std::shared_ptr<calibration_entry>& entry, const double* response, const int depth)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+
+                entry->response.assign(response, response + depth * CMP_MAX);
+                entry->depth = depth;
+                entry->ready = true;
+                _bytes += entry->response.size() * sizeof(double);
+
+                // Oldest first, skipping entries still being solved and the one just published.
+                for (auto it = _lru.end(); _bytes > REGISTRY_MAX_BYTES && it != _lru.begin();)
+                {
+                    --it;
+
+                    if (!(*it)->ready || *it == entry)
+                        continue;
+
+                    const std::shared_ptr<calibration_entry> victim = *it++;
+                    erase(victim);
+                }
+            }
+
+            _changed.notify_all();
+        }
+
+        void abandon(const std::shared_ptr<calibration_entry>& entry)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+
+                entry->failed = true;
+                erase(entry);
+            }
+
+            _changed.notify_all();
+        }
+
+        /// Blocks until another instance finishes the entry, true when it was published.
+        /// cancelled asks the host, so it is polled with the registry unlocked.
+        bool wait(const std::shared_ptr<calibration_entry>& entry, const std::function<bool()>& cancelled)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+
+            while (!entry->ready && !entry->failed)
+            {
+                lock.unlock();
+                const bool stop = cancelled();
+                lock.lock();
+
+                if (stop)
+                    return false;
+
+                _changed.wait_for(lock, std::chrono::milliseconds(50), [&]() { return entry->ready || entry->failed; });
+            }
+
+            return entry->ready;
+        }
+
+        /// Copies the published curves of entry into response.
+        bool copy(const std::shared_ptr<calibration_entry>& entry, const int depth, double* response)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            if (!entry->ready || entry->depth != depth)
+                return false;
+
+            std::copy(entry->response.begin(), entry->response.end(), response);
+            return true;
+        }
+
+    private:
+        calibration_registry() = default;
+
+        /// Called with the mutex held.
+        void erase(const std::shared_ptr<calibration_entry>& entry)
+        {
+            auto found = _index.find(entry->key);
+
+            if (found == _index.end() || *found->second != entry)
+                return;
+
+            if (entry->ready)
+                _bytes -= entry->response.size() * sizeof(double);
+
+            _lru.erase(found->second);
+            _index.erase(found);
+        }
+
+        std::mutex _mutex;
+        std::condition_variable _changed;
+        std::list<std::shared_ptr<calibration_entry>> _lru;
+        std::unordered_map<uint64_t, std::list<std::shared_ptr<calibration_entry>>::iterator> _index;
+        size_t _bytes = 0;
+    };
+
+    /// Runs solve once per key across the process. The first caller solves and publishes,
+    /// later ones copy the published curves, or wait when the solve is still running.
+    inline bool shared_solve(const uint64_t key,
+                             const int depth,
+                             double* response,
+                             const std::function<bool()>& cancelled,
+                             const std::function<bool(double*)>& solve)
+    {
+        calibration_registry& registry = calibration_registry::instance();
+
+        while (!cancelled())
+        {
+            bool owner = false;
+            std::shared_ptr<calibration_entry> entry = registry.acquire(key, owner);
+
+            if (owner)
+            {
+                const bool solved = solve(response);
+
+                if (solved)
+                    registry.publish(entry, response, depth);
+                else
+                    registry.abandon(entry);
+
+                return solved;
+            }
+
+            if (registry.wait(entry, cancelled) && registry.copy(entry, depth, response))
+            {
+                spdlog::debug("[{}] calibration {:016x} shared from the registry", fx::label, key);
+                return true;
+            }
+        }
+
+        return false;
+    }
+}
+
+#endif
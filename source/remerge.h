@@ -0,0 +1,117 @@
+//
+//  remerge.h
+//  MakeHDR
+//
+//  Created by Vahan Sosoyan 2024.
+//
+
+#ifndef remerge_h
+#define remerge_h
+
+#include "merge.h"
+
+#define REMERGE_PROBES 64
+
+
+namespace fx
+{
+    /// Word wise multiply-xor hash, fast enough to fingerprint image rows.
+    inline uint64_t fingerprint(const void* data, const size_t size, uint64_t hash)
+    {
+        const unsigned char* bytes = (const unsigned char*)data;
+        size_t i = 0;
+
+        for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+        {
+            uint64_t word;
+            std::memcpy(&word, bytes + i, sizeof(uint64_t));
+            hash = (hash ^ word) * 0x100000001b3ull;
+            hash ^= hash >> 29;
+        }
+
+        for (; i < size; ++i)
+            hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+
+        return hash;
+    }
+
+    /// Accumulated merge of the last rendered frame, before resolve, so that a change to one
+    /// source slot, its exposure time, clip or content, re-merges that source alone: its old
+    /// contribution is subtracted from the sums and the new one added. The bins of every slot
+    /// are kept to know what to subtract, 6 bytes per pixel and slot on top of 28 for the sums.
+    /// Holds one frame, so rendering another one replaces it, and scrubbing back and forth
+    /// between frames merges every source each time.
+    struct merge_cache
+    {
+    public:
+        void reset(const uint64_t frame, const int pixels)
+        {
+            key = frame;
+            valid = false;
+            weight.assign(pixels, 0.f);
+            sum.assign((size_t)pixels * CMP_MAX, 0.f);
+            fallback.assign((size_t)pixels * CMP_MAX, 0.f);
+            bins.assign(SRC_MAX, std::vector<uint16_t>());
+            present.assign(SRC_MAX, false);
+            exp_time_log.assign(SRC_MAX, 0.f);
+            fingerprints.assign(SRC_MAX, 0);
+            darkest = -1;
+        }
+
+        /// Loads block pixels from first, the index of the block's first pixel.
+        void load(const size_t first, merge_block& block) const
+        {
+            for (int p = 0; p < block.size; ++p)
+            {
+                block.weight[p] = weight[first + p];
+
+                for (int c = 0; c < CMP_MAX; ++c)
+                {
+                    block.sum[p][c] = sum[(first + p) * CMP_MAX + c];
+                    block.fallback[p][c] = fallback[(first + p) * CMP_MAX + c];
+                }
+            }
+        }
+
+        size_t bytes() const
+        {
+            size_t total = (weight.size() + sum.size() + fallback.size()) * sizeof(float);
+
+            for (const std::vector<uint16_t>& slot : bins)
+                total += slot.size() * sizeof(uint16_t);
+
+            return total;
+        }
+
+        void store(const size_t first, const merge_block& block)
+        {
+            for (int p = 0; p < block.size; ++p)
+            {
+                weight[first + p] = block.weight[p];
+
+                for (int c = 0; c < CMP_MAX; ++c)
+                {
+                    sum[(first + p) * CMP_MAX + c] = block.sum[p][c];
+                    fallback[(first + p) * CMP_MAX + c] = block.fallback[p][c];
+                }
+            }
+        }
+
+        /// Hash of the frame, window and tables the sums were merged with.
+        uint64_t key = 0;
+        bool valid = false;
+
+        std::vector<float> weight;
+        std::vector<float> sum;
+        std::vector<float> fallback;
+
+        /// Per source slot, as numbered by the node inputs.
+        std::vector<std::vector<uint16_t>> bins;
+        std::vector<bool> present;
+        std::vector<float> exp_time_log;
+        std::vector<uint64_t> fingerprints;
+        int darkest = -1;
+    };
+}
+
+#endif
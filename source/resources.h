@@ -13,9 +13,12 @@
 #include <random>
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
 #include <cfloat>
-#include <unordered_set>
 #include <cstdint>
+#include <cstring>
 
 #include "spdlog/spdlog.h"
 
@@ -30,7 +33,10 @@
 #define VERSION_FIX 0
 
 #define CMP_MAX 3
-#define SRC_MAX 16
+
+#ifndef SRC_MAX
+#define SRC_MAX 32
+#endif
 
 
 namespace fx
@@ -58,10 +64,78 @@ namespace fx
     
         int x;
         int y;
+    };
+
+    /// Cancellation flag shared between a solve and whoever started it.
+    class cancel_token
+    {
+    public:
+        void cancel() { _cancelled = true; }
+        bool cancelled() const { return _cancelled; }
+
+    private:
+        std::atomic<bool> _cancelled{ false };
+    };
+
+    /// Receives the fraction of a solve completed so far, in [0, 1].
+    typedef std::function<void(double)> progress_callback;
+
+    /// Read only view of precomputed bin indices stored planar, one plane per channel,
+    /// such as a bracket cache mapped from disk. Bins are quantised to depth levels.
+    template<typename btype>
+    struct bin_planes
+    {
+    public:
+        int bin(const int x, const int y, const int c) const { return plane[c][(size_t)y * width + x]; }
+        const btype* row(const int y, const int c) const { return plane[c] + (size_t)y * width; }
+
+        const btype* plane[CMP_MAX] = { nullptr, nullptr, nullptr };
+        int width = 0;
+        int height = 0;
+        int depth = 0;
+    };
+
+    /// Splits [0, rows) into one row range per thread of a host multithread call.
+    class row_processor : public OFX::MultiThread::Processor
+    {
+    public:
+        row_processor(const int rows, const std::function<void(int, int)>& fn) : _rows(rows),
+                                                                                 _fn(fn)
+        {
+        }
+
+        virtual void multiThreadFunction(unsigned int threadIndex, unsigned int threadMax)
+        {
+            const int chunk = (_rows + (int)threadMax - 1) / (int)threadMax;
+            const int first = (int)threadIndex * chunk;
+            const int last = std::min(_rows, first + chunk);
+
+            if (first < last)
+                _fn(first, last);
+        }
 
-        int64_t key() const { return (int64_t)x << 32 | (uint32_t)y; }
+    private:
+        const int _rows;
+        const std::function<void(int, int)>& _fn;
     };
 
+    /// Runs fn(first, last) over row ranges of [0, rows) on the threads the host grants the
+    /// plugin. Calls from a host spawned thread run inline, the suite is not reentrant.
+    inline void parallel_rows(const int rows, const std::function<void(int, int)>& fn)
+    {
+        if (rows <= 0)
+            return;
+
+        if (OFX::MultiThread::isSpawnedThread())
+        {
+            fn(0, rows);
+            return;
+        }
+
+        row_processor processor(rows, fn);
+        processor.multiThread(std::max(1u, std::min((unsigned int)rows, OFX::MultiThread::getNumCPUs())));
+    }
+
     class timer
     {
     public:
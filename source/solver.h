@@ -9,39 +9,238 @@
 #define solver_h
 
 #include "resources.h"
+#include "memory.h"
 
 
-/// Extracts the pixel value for a given point and channel, 
-/// returning an integer in the range [0, input_depth-1].
-template<typename ptype, typename ImageType>
-inline int extract_pixel_index(const std::shared_ptr<ImageType>& source, 
-            const fx::point& point, 
-            const int channel, 
-            const int input_depth)
+/// Bin indices of the sample points in every source and channel, gathered once and shared
+/// by all solvers. Each channel is a plane of samples by sources, so the solver of a channel
+/// walks contiguous memory, and the whole matrix is small enough to copy into a background
+/// solve after the host images are released.
+class sample_bins
 {
-    ptype* sample = (ptype*)source->getPixelAddress(point.x, point.y);
-    float sample_flt = sample == nullptr ? 0 : sample[channel];
-    sample_flt = std::min<float>(sample_flt, 1.f);
-    sample_flt = std::max<float>(sample_flt, 0.f);
+public:
+    sample_bins() = default;
 
-    return (int)(sample_flt * (input_depth - 1));
+    sample_bins(const int sources, const int samples, const int depth) : _sources(sources),
+                                                                         _samples(samples),
+                                                                         _depth(depth),
+                                                                         _bins((size_t)CMP_MAX * samples * sources, 0)
+    {
+    }
+
+    /// Reads source under every point shifted by offset, one pixel fetch for all channels.
+    /// Shifted points clamp to the image bounds, the edge pixels the merge reads there.
+    template<typename ptype, typename ImageType>
+    void gather(const int source, ImageType& image, const std::vector<fx::point>& points, const fx::point& offset)
+    {
+        const float scale = (float)(_depth - 1);
+        const OfxRectI bounds = image.getBounds();
+
+        for (int i = 0; i < _samples; ++i)
+        {
+            const int x = std::min(std::max(points[i].x + offset.x, bounds.x1), bounds.x2 - 1);
+            const int y = std::min(std::max(points[i].y + offset.y, bounds.y1), bounds.y2 - 1);
+            const ptype* pixel = (const ptype*)image.getPixelAddress(x, y);
+
+            for (int c = 0; c < CMP_MAX; ++c)
+            {
+                const float sample = pixel == nullptr ? 0.f : std::min<float>(std::max<float>(pixel[c], 0.f), 1.f);
+                at(c, i, source) = (uint16_t)(sample * scale);
+            }
+        }
+    }
+
+    /// Bin planes already hold indices, rescaled only when built for another depth.
+    template<typename btype>
+    void gather(const int source, const fx::bin_planes<btype>& planes, const std::vector<fx::point>& points)
+    {
+        for (int i = 0; i < _samples; ++i)
+        {
+            for (int c = 0; c < CMP_MAX; ++c)
+            {
+                const int bin = planes.bin(points[i].x, points[i].y, c);
+                at(c, i, source) = (uint16_t)(planes.depth == _depth ? bin : (int)((long long)bin * (_depth - 1) / (planes.depth - 1)));
+            }
+        }
+    }
+
+    /// Reads source from bins packed by pixel at this depth, pixel (x, y) of a width by height
+    /// buffer at packed + (y * width + x) * stride. Points outside the buffer read bin 0.
+    void gather(const int source,
+                const uint16_t* packed,
+                const int width,
+                const int height,
+                const int stride,
+                const std::vector<fx::point>& points)
+    {
+        for (int i = 0; i < _samples; ++i)
+        {
+            const fx::point& point = points[i];
+            const bool inside = point.x >= 0 && point.x < width && point.y >= 0 && point.y < height;
+            const uint16_t* pixel = packed + ((size_t)point.y * width + point.x) * stride;
+
+            for (int c = 0; c < CMP_MAX; ++c)
+                at(c, i, source) = inside ? pixel[c] : 0;
+        }
+    }
+
+    /// Every stride-th sample, for the passes of a budgeted solve.
+    sample_bins subset(const int stride) const
+    {
+        sample_bins result(_sources, (_samples + stride - 1) / stride, _depth);
+
+        for (int c = 0; c < CMP_MAX; ++c)
+            for (int i = 0; i < result._samples; ++i)
+                for (int j = 0; j < _sources; ++j)
+                    result.at(c, i, j) = (uint16_t)bin(c, i * stride, j);
+
+        return result;
+    }
+
+    int bin(const int c, const int i, const int j) const { return _bins[((size_t)c * _samples + i) * _sources + j]; }
+    const uint16_t* plane(const int c) const { return _bins.data() + (size_t)c * _samples * _sources; }
+    const std::vector<uint16_t>& data() const { return _bins; }
+
+    int sources() const { return _sources; }
+    int samples() const { return _samples; }
+    int depth() const { return _depth; }
+
+private:
+    uint16_t& at(const int c, const int i, const int j) { return _bins[((size_t)c * _samples + i) * _sources + j]; }
+
+    int _sources = 0;
+    int _samples = 0;
+    int _depth = 0;
+    std::vector<uint16_t> _bins;
+};
+
+/// Regular grid of sample points over the image. Robertson is given 100 times the
+/// samples to compensate for its sparse bin coverage.
+inline std::vector<fx::point> sample_grid(const int width, const int height, const int samples, const int solver_type)
+{
+    std::vector<fx::point> points;
+
+    const float aspect = (float)width / (float)height;
+
+    const int actual_samples = (solver_type == 1) ? samples * 100 : samples;
+    const int x_points = std::max(1, (int)(sqrt(aspect * actual_samples)));
+    const int y_points = std::max(1, actual_samples / x_points);
+
+    const int step_x = std::max(1, width / x_points);
+    const int step_y = std::max(1, height / y_points);
+
+    for (int i = 0, x = step_x / 2; i < x_points; i++, x += step_x)
+    {
+        for (int j = 0, y = step_y / 2; j < y_points; j++, y += step_y)
+        {
+            if (0 <= x && x < width && 0 <= y && y < height)
+                points.push_back(fx::point(x, y));
+        }
+    }
+
+    return points;
+}
+
+/// Fraction of the interior curve bins hit by at least one sample in any source and channel.
+inline float bin_coverage(const sample_bins& bins, const int input_depth)
+{
+    std::vector<bool> hit(input_depth, false);
+
+    for (const uint16_t bin : bins.data())
+        hit[bin] = true;
+
+    int covered = 0;
+    for (int i = 1; i < input_depth - 1; ++i)
+        covered += hit[i] ? 1 : 0;
+
+    return input_depth > 2 ? (float)covered / (input_depth - 2) : 1.f;
+}
+
+/// Weighted mean absolute difference between two sets of log response curves.
+inline double response_change(const int input_depth,
+                              const std::vector<float>& input_weights,
+                              const double* previous,
+                              const double* current)
+{
+    double change = 0.0;
+    double weight_sum = 0.0;
+
+    for (int c = 0; c < CMP_MAX; ++c)
+    {
+        for (int i = 0; i < input_depth; ++i)
+        {
+            change += input_weights[i] * std::abs(current[input_depth * c + i] - previous[input_depth * c + i]);
+            weight_sum += input_weights[i];
+        }
+    }
+
+    return weight_sum > 0.0 ? change / weight_sum : 0.0;
+}
+
+/// Damped CGLS for min |a * x - b|^2 + damping * |x|^2. Unlike a pseudo-inverse
+/// it only needs matrix-vector products, so cancellation is checked every iteration.
+inline bool cgls_solver(const arma::mat& a,
+                        const arma::vec& b,
+                        arma::vec& x,
+                        const double damping,
+                        const int max_iterations,
+                        const double tolerance,
+                        const fx::cancel_token& cancel,
+                        const fx::progress_callback& progress)
+{
+    x = arma::vec(a.n_cols).zeros();
+
+    arma::vec r = b;
+    arma::vec s = a.t() * r;
+    arma::vec p = s;
+
+    double gamma = arma::dot(s, s);
+    const double gamma_0 = gamma;
+
+    for (int iter = 0; iter < max_iterations; ++iter)
+    {
+        if (cancel.cancelled())
+            return false;
+
+        if (gamma <= tolerance * tolerance * gamma_0)
+            break;
+
+        const arma::vec q = a * p;
+        const double delta = arma::dot(q, q) + damping * arma::dot(p, p);
+
+        if (delta <= 0.0)
+            break;
+
+        const double alpha = gamma / delta;
+        x += alpha * p;
+        r -= alpha * q;
+        s = a.t() * r - damping * x;
+
+        const double gamma_next = arma::dot(s, s);
+        p = s + (gamma_next / gamma) * p;
+        gamma = gamma_next;
+
+        progress((double)(iter + 1) / max_iterations);
+    }
+
+    return x.is_finite();
 }
 
 /// Implements Paul E. Debevec & Jitendra Malik, 1997
 /// "Recovering High Dynamic Range Radiance Maps from Photographs"
-template<typename ptype, typename ImageType>
-void debevec_solver(const int channel,
+inline void debevec_solver(const int channel,
             const int input_depth,
             const float smoothness,
-            const std::vector<std::shared_ptr<ImageType>>& sources,
-            const std::vector<fx::point>& points,
+            const sample_bins& bins,
             const std::vector<float>& exp_times_log,
             const std::vector<float>& input_weights,
-            double* response)
+            double* response,
+            const fx::cancel_token& cancel,
+            const fx::progress_callback& progress)
 {
 
-    const int sources_size = (int)sources.size();
-    const int samples_size = (int)points.size();
+    const int sources_size = bins.sources();
+    const int samples_size = bins.samples();
 
     const int m = samples_size * sources_size + (input_depth - 2) + 1;
     const int n = input_depth + samples_size;
@@ -53,9 +252,12 @@ void debevec_solver(const int channel,
     int k = 0;
     for (int i = 0; i < samples_size; ++i)
     {
+        if (cancel.cancelled())
+            return;
+
         for (int j = 0; j < sources_size; ++j)
         {           
-            const int sample_int = extract_pixel_index<ptype, ImageType>(sources[j], points[i], channel, input_depth);
+            const int sample_int = bins.bin(channel, i, j);
 
             const float wij = input_weights[sample_int];
 
@@ -87,17 +289,34 @@ void debevec_solver(const int channel,
         k++;
     }
 
+    if (cancel.cancelled())
+        return;
+
+    progress(0.1);
+
     bool success = arma::solve(s, a, b);
+
+    if (cancel.cancelled())
+        return;
     
-    /// Fallback to SVD pseudo-inverse if the system is singular or ill-conditioned
+    /// Fallback to a damped iterative least squares solve if the system is singular or ill-conditioned
     if (!success)
     {
-        arma::mat a_pinv;
-        success = arma::pinv(a_pinv, a);
-        if (success)
-            s = a_pinv * b;
+        spdlog::debug("{}: Direct solve failed for channel {}, falling back to CGLS", fx::label, channel);
+
+        const double damping = 1e-9 * std::pow(arma::norm(a, "fro"), 2) / n;
+
+        success = cgls_solver(a, b, s, damping, 1000, 1e-8, cancel, [&](double value)
+        {
+            progress(0.1 + 0.9 * value);
+        });
+
+        if (cancel.cancelled())
+            return;
     }
 
+    progress(1.0);
+
     if (success)
     {
         for (int i = 0; i < input_depth; ++i)
@@ -107,40 +326,670 @@ void debevec_solver(const int channel,
         spdlog::error("{}: Solver has failed for channel {}!", fx::label , channel);
 }
 
-/// Implements Mark A. Robertson et al., 1999
-/// "Dynamic Range Improvement Through Multiple Exposures"
-template<typename ptype, typename ImageType>
-void robertson_solver(const int channel,
-                      const int input_depth,
-                      const int iterations,
-                      const std::vector<std::shared_ptr<ImageType>>& sources,
-                      const std::vector<fx::point>& points,
-                      const std::vector<float>& exp_times,
-                      const std::vector<float>& input_weights,
-                      double* response)
+/// Normal equations of the Debevec system reduced to the curve alone. The log radiance of a
+/// sample only meets the curve through its own data rows, so it is eliminated in closed form,
+/// leaving S * g = rhs over input_depth unknowns, with S = G - C * De^-1 * C^T. Products
+/// with S cost one pass over the samples, and the pentadiagonal smoothness part plus the
+/// diagonal of the data part, factored once, make a preconditioner that absorbs the
+/// ill-conditioning of the second derivative.
+class debevec_reduced
 {
+public:
+    debevec_reduced(const int input_depth,
+                    const float lambda,
+                    const std::vector<int>& sample_ints,
+                    const int sources_size,
+                    const std::vector<float>& exp_times_log,
+                    const std::vector<float>& input_weights) : _depth(input_depth),
+                                                               _sources(sources_size),
+                                                               _samples((int)sample_ints.size() / sources_size),
+                                                               _bins(sample_ints),
+                                                               _w2(sample_ints.size()),
+                                                               _de(_samples, 0.0),
+                                                               _tl(exp_times_log.begin(), exp_times_log.end()),
+                                                               _data(input_depth, 0.0),
+                                                               _smooth(std::max(0, input_depth - 2)),
+                                                               _u(_samples),
+                                                               rhs(input_depth, 0.0)
+    {
+        for (size_t k = 0; k < _bins.size(); ++k)
+        {
+            const double w = input_weights[_bins[k]];
+            _w2[k] = w * w;
+            _de[k / _sources] += _w2[k];
+            _data[_bins[k]] += _w2[k];
+        }
 
-    const int sources_size = (int)sources.size();
-    const int samples_size = (int)points.size();
+        /// 3. Smoothness rows lambda * w(z) * (g(z-1) - 2*g(z) + g(z+1)), as in debevec_solver.
+        for (int i = 0; i < input_depth - 2; ++i)
+            _smooth[i] = (double)(lambda * input_weights[i + 1]);
 
-    std::vector<double> I(input_depth);
-    for (int i = 0; i < input_depth; ++i)
-        I[i] = (double)i / (double)(input_depth - 1);
+        /// rhs = r_g - C * De^-1 * r_e, where r_g and r_e hold a^T * b for the curve and radiance.
+        std::vector<double> r_e(_samples, 0.0);
 
-    std::vector<double> E(samples_size, 0.0);
+        for (int i = 0; i < _samples; ++i)
+        {
+            for (int j = 0; j < _sources; ++j)
+            {
+                const int k = i * _sources + j;
+                rhs[_bins[k]] += _w2[k] * _tl[j];
+                r_e[i] -= _w2[k] * _tl[j];
+            }
+        }
+
+        couple(r_e, rhs);
+        factor();
+    }
+
+    /// out = S * v
+    void multiply(const std::vector<double>& v, std::vector<double>& out)
+    {
+        for (int z = 0; z < _depth; ++z)
+            out[z] = _data[z] * v[z];
+
+        /// 2. Mid-Value Constraint
+        out[_depth / 2] += v[_depth / 2];
+
+        for (int i = 0; i < _depth - 2; ++i)
+        {
+            const double s = _smooth[i];
+            const double row = s * (v[i] - 2.0 * v[i + 1] + v[i + 2]);
+
+            out[i] += s * row;
+            out[i + 1] -= 2.0 * s * row;
+            out[i + 2] += s * row;
+        }
+
+        /// u = C^T * v, then out -= C * De^-1 * u
+        for (int i = 0; i < _samples; ++i)
+        {
+            double sum = 0.0;
+
+            for (int j = 0; j < _sources; ++j)
+                sum -= _w2[i * _sources + j] * v[_bins[i * _sources + j]];
+
+            _u[i] = sum;
+        }
+
+        couple(_u, out);
+    }
+
+    /// z = P^-1 * r with the banded Cholesky factor of the preconditioner.
+    void precondition(const std::vector<double>& r, std::vector<double>& z) const
+    {
+        for (int k = 0; k < _depth; ++k)
+        {
+            double sum = r[k];
+
+            if (k > 0) sum -= _l1[k] * z[k - 1];
+            if (k > 1) sum -= _l2[k] * z[k - 2];
+
+            z[k] = sum / _l0[k];
+        }
+
+        for (int k = _depth - 1; k >= 0; --k)
+        {
+            double sum = z[k];
+
+            if (k + 1 < _depth) sum -= _l1[k + 1] * z[k + 1];
+            if (k + 2 < _depth) sum -= _l2[k + 2] * z[k + 2];
+
+            z[k] = sum / _l0[k];
+        }
+    }
+
+private:
+    /// out -= C * De^-1 * v, where C[z][i] = -sum of w^2 over the sources of sample i in bin z.
+    void couple(const std::vector<double>& v, std::vector<double>& out) const
+    {
+        for (int i = 0; i < _samples; ++i)
+        {
+            if (_de[i] <= 0.0)
+                continue;
+
+            const double scaled = v[i] / _de[i];
+
+            for (int j = 0; j < _sources; ++j)
+                out[_bins[i * _sources + j]] += _w2[i * _sources + j] * scaled;
+        }
+    }
+
+    /// Cholesky factor of the smoothness and mid-value rows plus the diagonal of S's data part,
+    /// stored by band: l0 the diagonal, l1 and l2 the first and second subdiagonals.
+    void factor()
+    {
+        std::vector<double> a0(_data), a1(_depth, 0.0), a2(_depth, 0.0);
+
+        /// diag(C * De^-1 * C^T), counting every bin of a sample once with its summed weight.
+        for (int i = 0; i < _samples; ++i)
+        {
+            if (_de[i] <= 0.0)
+                continue;
+
+            for (int j = 0; j < _sources; ++j)
+            {
+                const int bin = _bins[i * _sources + j];
+                bool first = true;
+                double c = 0.0;
+
+                for (int o = 0; o < _sources; ++o)
+                {
+                    if (_bins[i * _sources + o] != bin)
+                        continue;
+
+                    first = first && o >= j;
+                    c += _w2[i * _sources + o];
+                }
+
+                if (first)
+                    a0[bin] -= c * c / _de[i];
+            }
+        }
+
+        a0[_depth / 2] += 1.0;
+
+        for (int i = 0; i < _depth - 2; ++i)
+        {
+            const double s2 = _smooth[i] * _smooth[i];
+
+            a0[i] += s2;
+            a0[i + 1] += 4.0 * s2;
+            a0[i + 2] += s2;
+            a1[i] -= 2.0 * s2;
+            a1[i + 1] -= 2.0 * s2;
+            a2[i] += s2;
+        }
+
+        double ridge = 0.0;
+        for (int k = 0; k < _depth; ++k)
+            ridge = std::max(ridge, a0[k]);
+
+        ridge = std::max(ridge * 1e-10, 1e-12);
+
+        _l0.assign(_depth, 0.0);
+        _l1.assign(_depth + 1, 0.0);
+        _l2.assign(_depth + 2, 0.0);
+
+        for (int k = 0; k < _depth; ++k)
+        {
+            const double pivot = std::max(a0[k] - _l1[k] * _l1[k] - _l2[k] * _l2[k], 0.0) + ridge;
+            _l0[k] = std::sqrt(pivot);
+
+            if (k + 1 < _depth)
+                _l1[k + 1] = (a1[k] - _l2[k + 1] * _l1[k]) / _l0[k];
+
+            if (k + 2 < _depth)
+                _l2[k + 2] = a2[k] / _l0[k];
+        }
+    }
+
+    int _depth;
+    int _sources;
+    int _samples;
+    std::vector<int> _bins;
+    std::vector<double> _w2;
+    std::vector<double> _de;
+    std::vector<double> _tl;
+    std::vector<double> _data;
+    std::vector<double> _smooth;
+    std::vector<double> _u;
+    std::vector<double> _l0;
+    std::vector<double> _l1;
+    std::vector<double> _l2;
+
+public:
+    std::vector<double> rhs;
+};
+
+/// Preconditioned conjugate gradients on the reduced Debevec system, starting from g.
+inline bool pcg_solver(debevec_reduced& system,
+                       std::vector<double>& g,
+                       const int max_iterations,
+                       const double tolerance,
+                       const fx::cancel_token& cancel,
+                       const fx::progress_callback& progress)
+{
+    const int n = (int)g.size();
+    std::vector<double> r(n), z(n), p(n), q(n);
+
+    system.multiply(g, q);
+
+    double rhs_norm = 0.0;
+    for (int k = 0; k < n; ++k)
+    {
+        r[k] = system.rhs[k] - q[k];
+        rhs_norm += system.rhs[k] * system.rhs[k];
+    }
+
+    system.precondition(r, z);
+    p = z;
+
+    double rz = 0.0;
+    double rr = 0.0;
+    for (int k = 0; k < n; ++k)
+    {
+        rz += r[k] * z[k];
+        rr += r[k] * r[k];
+    }
+
+    int iter = 0;
+    for (; iter < max_iterations && rr > tolerance * tolerance * rhs_norm; ++iter)
+    {
+        if (cancel.cancelled())
+            return false;
+
+        system.multiply(p, q);
+
+        double pq = 0.0;
+        for (int k = 0; k < n; ++k)
+            pq += p[k] * q[k];
+
+        if (pq <= 0.0)
+            break;
+
+        const double alpha = rz / pq;
+        rr = 0.0;
+
+        for (int k = 0; k < n; ++k)
+        {
+            g[k] += alpha * p[k];
+            r[k] -= alpha * q[k];
+            rr += r[k] * r[k];
+        }
+
+        system.precondition(r, z);
+
+        double rz_next = 0.0;
+        for (int k = 0; k < n; ++k)
+            rz_next += r[k] * z[k];
+
+        const double beta = rz_next / rz;
+        rz = rz_next;
+
+        for (int k = 0; k < n; ++k)
+            p[k] = z[k] + beta * p[k];
+
+        progress((double)(iter + 1) / max_iterations);
+    }
+
+    spdlog::debug("[{}] iterative solve converged in {} iterations", fx::label, iter);
+
+    for (const double value : g)
+        if (!std::isfinite(value))
+            return false;
+
+    return true;
+}
+
+/// Solves the same least squares problem as debevec_solver by pcg_solver, starting from initial
+/// when given and from a log-linear curve otherwise. Never builds the dense system, so memory
+/// stays linear in the samples, and a start close to the solution converges in a few iterations.
+inline void debevec_iterative_solver(const int channel,
+                                     const int input_depth,
+                                     const float smoothness,
+                                     const sample_bins& bins,
+                                     const std::vector<float>& exp_times_log,
+                                     const std::vector<float>& input_weights,
+                                     const double* initial,
+                                     double* response,
+                                     const fx::cancel_token& cancel,
+                                     const fx::progress_callback& progress)
+{
+    const int sources_size = bins.sources();
+    const int samples_size = bins.samples();
+
+    const uint16_t* plane = bins.plane(channel);
+    const std::vector<int> sample_ints(plane, plane + samples_size * sources_size);
+
+    const float lambda = smoothness * (input_depth / 256.f);
+    debevec_reduced system(input_depth, lambda, sample_ints, sources_size, exp_times_log, input_weights);
+
+    std::vector<double> g(input_depth);
+    for (int z = 0; z < input_depth; ++z)
+        g[z] = initial != nullptr ? initial[z] : std::log((z + 0.5) / (input_depth / 2 + 0.5));
+
+    progress(0.1);
+
+    const bool success = pcg_solver(system, g, 4 * input_depth, 1e-10, cancel, [&](double value)
+    {
+        progress(0.1 + 0.9 * value);
+    });
+
+    if (cancel.cancelled())
+        return;
+
+    progress(1.0);
+
+    if (success)
+        std::copy(g.begin(), g.end(), response);
+    else
+        spdlog::error("{}: Solver has failed for channel {}!", fx::label, channel);
+}
+
+/// Peak bytes the solver of one channel allocates for samples by sources points at the input
+/// depth, from the sizes of its system. Dense Debevec holds the m x n system twice in double,
+/// as the least squares solve works on a copy, the mixed precision solver holds it once in
+/// float with the normal matrix and its factor, the iterative solver the reduced system only.
+inline size_t solver_memory(const int solver_type, const int input_depth, const int samples, const int sources)
+{
+    const size_t points = (size_t)samples * sources;
+    const size_t m = points + input_depth - 1;
+    const size_t n = (size_t)input_depth + samples;
+
+    if (solver_type == 0)
+        return 2 * m * n * sizeof(double) + 2 * m * sizeof(double);
+    if (solver_type == 3)
+        return m * n * sizeof(float) + 2 * n * n * sizeof(float) + m * sizeof(double) + 6 * n * sizeof(double);
+    if (solver_type == 2)
+        return points * (sizeof(int) + sizeof(double)) + 2 * samples * sizeof(double) + 16 * input_depth * sizeof(double);
+
+    return points * sizeof(double) + 2 * samples * sizeof(double) + 4 * input_depth * sizeof(double);
+}
+
+/// The Debevec system of debevec_solver, factored in single precision. Every entry of the
+/// system is a float product already, so storing it as fmat loses nothing, and the normal
+/// equations are solved to double accuracy by refining against residuals accumulated in
+/// double. Falls back when the factorization fails or refinement stalls, to debevec_solver,
+/// or to debevec_iterative_solver when the dense double system does not fit in budget bytes,
+/// 0 for no limit. A stall sets stalled, and the channels after it go to the fallback without
+/// building a system of the same conditioning, as they would when this one does not fit.
+inline void debevec_mixed_solver(const int channel,
+                                 const int input_depth,
+                                 const float smoothness,
+                                 const sample_bins& bins,
+                                 const std::vector<float>& exp_times_log,
+                                 const std::vector<float>& input_weights,
+                                 const size_t budget,
+                                 std::atomic<bool>& stalled,
+                                 double* response,
+                                 const fx::cancel_token& cancel,
+                                 const fx::progress_callback& progress)
+{
+    const int sources_size = bins.sources();
+    const int samples_size = bins.samples();
+
+    const int m = samples_size * sources_size + (input_depth - 2) + 1;
+    const int n = input_depth + samples_size;
+
+    const bool dense = budget == 0 || solver_memory(0, input_depth, samples_size, sources_size) <= budget;
+
+    const auto fallback = [&]()
+    {
+        if (dense)
+            debevec_solver(channel, input_depth, smoothness, bins, exp_times_log, input_weights, response, cancel, progress);
+        else
+            debevec_iterative_solver(channel, input_depth, smoothness, bins, exp_times_log, input_weights, nullptr, response, cancel, progress);
+    };
+
+    if (stalled || (budget != 0 && solver_memory(3, input_depth, samples_size, sources_size) > budget))
+    {
+        spdlog::debug("[{}] mixed precision skipped for channel {}, solving {}", fx::label, channel, dense ? "dense" : "iterative");
+        fallback();
+        return;
+    }
 
-    /// Precompute sample integers to avoid fetching pixel data during iterations
-    std::vector<std::vector<int>> sample_ints(samples_size, std::vector<int>(sources_size));
+    arma::fmat a = arma::fmat(m, n).zeros();
+    std::vector<float> b(m, 0.f);
+
+    int k = 0;
     for (int i = 0; i < samples_size; ++i)
     {
+        if (cancel.cancelled())
+            return;
+
         for (int j = 0; j < sources_size; ++j)
         {
-            sample_ints[i][j] = extract_pixel_index<ptype, ImageType>(sources[j], points[i], channel, input_depth);
+            const int sample_int = bins.bin(channel, i, j);
+
+            const float wij = input_weights[sample_int];
+
+            a.at(k, sample_int) = wij;
+            a.at(k, input_depth + i) = -wij;
+            b[k] = wij * exp_times_log[j];
+            k++;
         }
     }
 
+    a.at(k, input_depth / 2) = 1;
+    k++;
+
+    const float lambda = smoothness * (input_depth / 256.f);
+
+    for (int i = 0; i < (input_depth - 2); ++i)
+    {
+        float wi = input_weights[i + 1];
+
+        a.at(k, i) = lambda * wi;
+        a.at(k, i + 1) = -2 * lambda * wi;
+        a.at(k, i + 2) = lambda * wi;
+        k++;
+    }
+
+    if (cancel.cancelled())
+        return;
+
+    progress(0.1);
+
+    /// Normal equations scaled to a unit diagonal, so single precision holds the factor of
+    /// bins with tiny weights as well as busy ones, plus a ridge keeping it positive definite.
+    arma::fmat normal = a.t() * a;
+    std::vector<double> scale(n);
+
+    for (int i = 0; i < n; ++i)
+        scale[i] = normal.at(i, i) > 0.f ? 1.0 / std::sqrt((double)normal.at(i, i)) : 0.0;
+
+    for (int col = 0; col < n; ++col)
+        for (int row = 0; row < n; ++row)
+            normal.at(row, col) = (float)(normal.at(row, col) * scale[row] * scale[col]);
+
+    for (int i = 0; i < n; ++i)
+        normal.at(i, i) += 1e-6f;
+
+    arma::fmat r;
+    bool success = arma::chol(r, normal);
+
+    normal.reset();
+
+    if (cancel.cancelled())
+        return;
+
+    progress(0.6);
+
+    std::vector<double> s(n, 0.0);
+    std::vector<double> residual(m);
+
+    /// out = a^T * a * v, accumulated in double from the float system.
+    const auto multiply = [&](const std::vector<double>& v, std::vector<double>& out)
+    {
+        std::fill(residual.begin(), residual.end(), 0.0);
+
+        for (int col = 0; col < n; ++col)
+        {
+            const float* column = a.colptr(col);
+
+            if (v[col] != 0.0)
+                for (int row = 0; row < m; ++row)
+                    residual[row] += (double)column[row] * v[col];
+        }
+
+        for (int col = 0; col < n; ++col)
+        {
+            const float* column = a.colptr(col);
+            double sum = 0.0;
+
+            for (int row = 0; row < m; ++row)
+                sum += (double)column[row] * residual[row];
+
+            out[col] = sum;
+        }
+    };
+
+    /// out = scale * (r^T * r)^-1 * scale * v with the float upper triangular factor.
+    const auto precondition = [&](const std::vector<double>& v, std::vector<double>& out)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            const float* column = r.colptr(i);
+            double sum = v[i] * scale[i];
+
+            for (int j = 0; j < i; ++j)
+                sum -= (double)column[j] * out[j];
+
+            out[i] = sum / column[i];
+        }
+
+        for (int i = n - 1; i >= 0; --i)
+        {
+            double sum = out[i];
+
+            for (int j = i + 1; j < n; ++j)
+                sum -= (double)r.at(i, j) * out[j];
+
+            out[i] = sum / r.at(i, i);
+        }
+
+        for (int i = 0; i < n; ++i)
+            out[i] *= scale[i];
+    };
+
+    /// Refinement in double, as conjugate gradients preconditioned by the float factor,
+    /// which also converges where plain residual correction would stall on the ridge.
+    std::vector<double> gradient(n, 0.0);
+    std::vector<double> z(n);
+    std::vector<double> p(n);
+    std::vector<double> q(n);
+
+    for (int row = 0; row < m; ++row)
+        if (b[row] != 0.f)
+            for (int col = 0; col < n; ++col)
+                gradient[col] += (double)a.at(row, col) * b[row];
+
+    const int max_refinements = 30;
+    const double tolerance = 1e-9;
+
+    double norm = 0.0;
+    for (int i = 0; i < n; ++i)
+        norm += gradient[i] * gradient[i];
+
+    const double norm_0 = std::sqrt(norm);
+    int refinements = 0;
+
+    if (success)
+    {
+        precondition(gradient, z);
+        p = z;
+    }
+
+    double rz = 0.0;
+    for (int i = 0; i < n; ++i)
+        rz += gradient[i] * z[i];
+
+    while (success && std::sqrt(norm) > tolerance * norm_0)
+    {
+        if (cancel.cancelled())
+            return;
+
+        /// Stalled, the single precision factor is too far off the system to converge.
+        if (refinements == max_refinements || !std::isfinite(norm))
+        {
+            success = false;
+            break;
+        }
+
+        multiply(p, q);
+
+        double pq = 0.0;
+        for (int i = 0; i < n; ++i)
+            pq += p[i] * q[i];
+
+        if (pq <= 0.0)
+        {
+            success = false;
+            break;
+        }
+
+        const double alpha = rz / pq;
+        norm = 0.0;
+
+        for (int i = 0; i < n; ++i)
+        {
+            s[i] += alpha * p[i];
+            gradient[i] -= alpha * q[i];
+            norm += gradient[i] * gradient[i];
+        }
+
+        precondition(gradient, z);
+
+        double rz_next = 0.0;
+        for (int i = 0; i < n; ++i)
+            rz_next += gradient[i] * z[i];
+
+        for (int i = 0; i < n; ++i)
+            p[i] = z[i] + (rz_next / rz) * p[i];
+
+        rz = rz_next;
+        refinements++;
+
+        progress(0.6 + 0.4 * refinements / max_refinements);
+    }
+
+    if (!success)
+    {
+        spdlog::debug("[{}] mixed precision solve stalled for channel {}, falling back to {}", fx::label, channel, dense ? "dense" : "iterative");
+
+        stalled = true;
+
+        a.reset();
+        r.reset();
+
+        fallback();
+        return;
+    }
+
+    spdlog::debug("[{}] mixed precision solve for channel {} refined in {} steps", fx::label, channel, refinements);
+
+    progress(1.0);
+
+    /// Shifting every g and ln(E) together only changes the mid-value row, so the slowest
+    /// converging direction is settled exactly by moving g(Z_mid) back to zero.
+    const double offset = s[input_depth / 2];
+
+    for (int i = 0; i < input_depth; ++i)
+        response[i] = s[i] - offset;
+}
+
+/// Implements Mark A. Robertson et al., 1999
+/// "Dynamic Range Improvement Through Multiple Exposures"
+inline void robertson_solver(const int channel,
+                             const int input_depth,
+                             const int iterations,
+                             const sample_bins& bins,
+                             const std::vector<float>& exp_times,
+                             const std::vector<float>& input_weights,
+                             double* response,
+                             const fx::cancel_token& cancel,
+                             const fx::progress_callback& progress)
+{
+
+    const int sources_size = bins.sources();
+    const int samples_size = bins.samples();
+
+    std::vector<double> I(input_depth);
+    for (int i = 0; i < input_depth; ++i)
+        I[i] = (double)i / (double)(input_depth - 1);
+
+    std::vector<double> E(samples_size, 0.0);
+
+    /// Samples by sources plane of the gathered bins for this channel
+    const uint16_t* sample_ints = bins.plane(channel);
+
     for (int iter = 0; iter < iterations; ++iter)
     {
+        if (cancel.cancelled())
+            return;
+
+        progress((double)iter / iterations);
+
         /// 1. Estimate irradiance E for each sample
         /// x_j = sum(w(y_ij) * t_i * I(y_ij)) / sum(w(y_ij) * t_i^2)
         for (int i = 0; i < samples_size; ++i)
@@ -150,7 +999,7 @@ void robertson_solver(const int channel,
 
             for (int j = 0; j < sources_size; ++j)
             {
-                const int s_int = sample_ints[i][j];
+                const int s_int = sample_ints[i * sources_size + j];
                 const double w = input_weights[s_int];
                 const double t = exp_times[j];
 
@@ -170,7 +1019,7 @@ void robertson_solver(const int channel,
         {
             for (int j = 0; j < sources_size; ++j)
             {
-                const int s_int = sample_ints[i][j];
+                const int s_int = sample_ints[i * sources_size + j];
                 const double t = exp_times[j];
 
                 sum_I_num[s_int] += t * E[i];
@@ -223,6 +1072,8 @@ void robertson_solver(const int channel,
         }
     }
 
+    progress(1.0);
+
     /// 6. Output Logarithmic Response exactly like Debevec so processor logic stays identical
     for (int m = 0; m < input_depth; ++m)
     {
@@ -233,4 +1084,307 @@ void robertson_solver(const int channel,
     }
 }
 
+/// Shares one curve across the channels stored back to back in response.
+inline void robertson_average_curves(const int input_depth, double* response)
+{
+    /// Robertson runs per-channel independently, producing divergent curve shapes
+    /// on sparse linear data. Average them into one shared curve to eliminate tints,
+    /// then smooth to remove kinks from sparsely-sampled bins near highlights.
+    for (int m = 0; m < input_depth; ++m)
+    {
+        double avg = 0.0;
+        for (int c = 0; c < CMP_MAX; ++c)
+            avg += response[input_depth * c + m];
+        avg /= CMP_MAX;
+        for (int c = 0; c < CMP_MAX; ++c)
+            response[input_depth * c + m] = avg;
+    }
+
+    /// 3 passes of box-filter smoothing approximates a Gaussian kernel,
+    /// handling broader plateau-type banding from sparsely-sampled highlight bins.
+    const int radius = 4;
+    const int passes = 3;
+    std::vector<double> smoothed(input_depth);
+    for (int pass = 0; pass < passes; ++pass)
+    {
+        const double* curve = response;
+        for (int m = 0; m < input_depth; ++m)
+        {
+            double sum = 0.0;
+            int count = 0;
+            for (int k = std::max(0, m - radius); k <= std::min(input_depth - 1, m + radius); ++k)
+            {
+                sum += curve[k];
+                ++count;
+            }
+            smoothed[m] = sum / count;
+        }
+        for (int m = 0; m < input_depth; ++m)
+            for (int c = 0; c < CMP_MAX; ++c)
+                response[input_depth * c + m] = smoothed[m];
+    }
+}
+
+/// Picks the solver and the number of channels solved at once that fit in budget bytes, 0 for
+/// no limit. The requested solver keeps as many channels in flight as fit; when not even one
+/// does, dense Debevec steps down to the mixed precision system, then to the iterative solver
+/// on the reduced system, which needs a fraction of the memory and is the last resort.
+inline int fit_solver(const size_t budget,
+                      const int solver_type,
+                      const int input_depth,
+                      const int samples,
+                      const int sources,
+                      int& concurrency)
+{
+    concurrency = CMP_MAX;
+
+    if (budget == 0)
+        return solver_type;
+
+    std::vector<int> candidates = { solver_type };
+
+    if (solver_type == 0)
+        candidates.push_back(3);
+    if (solver_type == 0 || solver_type == 3)
+        candidates.push_back(2);
+
+    for (const int candidate : candidates)
+    {
+        const size_t bytes = solver_memory(candidate, input_depth, samples, sources);
+
+        if (bytes <= budget)
+        {
+            concurrency = (int)std::min<size_t>(CMP_MAX, budget / bytes);
+
+            if (candidate != solver_type || concurrency < CMP_MAX)
+                spdlog::info("[{}] memory budget {}MB fits solver {} on {} channels at once, {:.1f}MB each", fx::label,
+                    budget >> 20, candidate, concurrency, (double)bytes / (1 << 20));
+
+            return candidate;
+        }
+    }
+
+    concurrency = 1;
+
+    spdlog::warn("[{}] memory budget {}MB is below the {:.1f}MB the solver needs, solving one channel at a time", fx::label,
+        budget >> 20, (double)solver_memory(candidates.back(), input_depth, samples, sources) / (1 << 20));
+
+    return candidates.back();
+}
+
+/// Runs the selected solver on up to concurrency threads, one channel at a time each, while
+/// the calling thread reports the combined progress to monitor. Free of any processor state
+/// so that a background calibration can keep running after the processor is gone.
+/// Solver types are 0 debevec, 1 robertson, 2 debevec iterative, which starts from
+/// the curves in initial when not null, and 3 debevec mixed precision, whose fallback
+/// follows memory_budget in bytes, 0 for no limit.
+inline bool solve_channels(const int solver_type,
+                           const int input_depth,
+                           const float smoothness,
+                           const sample_bins& bins,
+                           const std::vector<float>& exp_times,
+                           const std::vector<float>& exp_times_log,
+                           const std::vector<float>& input_weights,
+                           const double* initial,
+                           double* response,
+                           const fx::cancel_token& cancel,
+                           const fx::progress_callback& monitor,
+                           const int concurrency = CMP_MAX,
+                           const size_t memory_budget = 0)
+{
+    std::atomic<double> progress[CMP_MAX];
+    std::atomic<int> finished{ 0 };
+    std::atomic<int> next{ 0 };
+    std::atomic<bool> stalled{ false };
+    std::vector<std::thread> threads;
+
+    const size_t bytes = solver_memory(solver_type, input_depth, bins.samples(), bins.sources());
+
+    for (int c = 0; c < CMP_MAX; ++c)
+        progress[c] = 0.0;
+
+    for (int t = 0; t < std::max(1, std::min(concurrency, CMP_MAX)); ++t)
+    {
+        threads.push_back(std::thread([&]()
+        {
+            for (int c = next++; c < CMP_MAX; c = next++)
+            {
+                fx::memory_scope memory(fx::memory_ledger::instance().solver, bytes);
+
+                const fx::progress_callback report = [&progress, c](double value) { progress[c] = value; };
+
+                if (solver_type == 0)
+                {
+                    debevec_solver(c,
+                                   input_depth,
+                                   smoothness,
+                                   bins,
+                                   exp_times_log,
+                                   input_weights,
+                                   response + input_depth * c,
+                                   cancel,
+                                   report);
+                }
+                else if (solver_type == 1)
+                {
+                    robertson_solver(c,
+                                     input_depth,
+                                     (int)smoothness,
+                                     bins,
+                                     exp_times,
+                                     input_weights,
+                                     response + input_depth * c,
+                                     cancel,
+                                     report);
+                }
+                else if (solver_type == 2)
+                {
+                    debevec_iterative_solver(c,
+                                             input_depth,
+                                             smoothness,
+                                             bins,
+                                             exp_times_log,
+                                             input_weights,
+                                             initial != nullptr ? initial + input_depth * c : nullptr,
+                                             response + input_depth * c,
+                                             cancel,
+                                             report);
+                }
+                else if (solver_type == 3)
+                {
+                    debevec_mixed_solver(c,
+                                         input_depth,
+                                         smoothness,
+                                         bins,
+                                         exp_times_log,
+                                         input_weights,
+                                         memory_budget,
+                                         stalled,
+                                         response + input_depth * c,
+                                         cancel,
+                                         report);
+                }
+
+                ++finished;
+            }
+        }));
+    }
+
+    while (finished < CMP_MAX)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+        if (monitor)
+        {
+            double total = 0.0;
+            for (int c = 0; c < CMP_MAX; ++c)
+                total += progress[c];
+
+            monitor(total / CMP_MAX);
+        }
+    }
+
+    for (std::thread& thread : threads)
+        thread.join();
+
+    if (cancel.cancelled())
+        return false;
+
+    if (solver_type == 1)
+        robertson_average_curves(input_depth, response);
+
+    return true;
+}
+
+/// Solves with every point, or with a growing subset of them when a time budget is set.
+/// Each pass of a budgeted solve starts from the curves of the previous one.
+inline bool solve_response(const int budget,
+                           const float target_coverage,
+                           const int solver_type,
+                           const int input_depth,
+                           const float smoothness,
+                           const sample_bins& bins,
+                           const std::vector<float>& exp_times,
+                           const std::vector<float>& exp_times_log,
+                           const std::vector<float>& input_weights,
+                           const double* initial,
+                           double* response,
+                           const fx::cancel_token& cancel,
+                           const fx::progress_callback& monitor,
+                           const int concurrency = CMP_MAX,
+                           const size_t memory_budget = 0)
+{
+    if (budget <= 0)
+    {
+        return solve_channels(solver_type, input_depth, smoothness, bins,
+                              exp_times, exp_times_log, input_weights, initial, response, cancel, monitor, concurrency, memory_budget);
+    }
+
+    /// Start from every stride-th point and halve the stride while the curve keeps
+    /// changing or the bins are not yet covered, as long as the next solve is expected
+    /// to fit in the budget. Doubling the samples is assumed to cost at least twice as much.
+    const int min_samples = 16;
+    const double tolerance = 1e-3;
+
+    int stride = 1;
+    while (bins.samples() / (stride * 2) >= min_samples)
+        stride *= 2;
+
+    fx::timer timer;
+    std::vector<double> previous;
+    std::vector<double> current(input_depth * CMP_MAX);
+    long long last_time = 0;
+    float last_coverage = 0.f;
+    int used = 0;
+
+    const fx::progress_callback report = [&](double)
+    {
+        if (monitor)
+            monitor(std::min(1.0, (double)timer.get() / budget));
+    };
+
+    for (;; stride /= 2)
+    {
+        const sample_bins subset = bins.subset(stride);
+
+        const long long start = timer.get();
+
+        if (!solve_channels(solver_type, input_depth, smoothness, subset, exp_times, exp_times_log,
+                            input_weights, previous.empty() ? initial : previous.data(), current.data(), cancel, report, concurrency, memory_budget))
+            return false;
+
+        const long long solve_time = std::max(1LL, timer.get() - start);
+        const double change = previous.empty()
+            ? DBL_MAX
+            : response_change(input_depth, input_weights, previous.data(), current.data());
+        const float coverage = bin_coverage(subset, input_depth);
+
+        previous.swap(current);
+        used = subset.samples();
+
+        spdlog::debug("[{}] budgeted calibration: {} samples, {}ms, change {}, coverage {}", fx::label,
+            used, solve_time, change, coverage);
+
+        if (stride == 1)
+            break;
+
+        if (change < tolerance && (coverage >= target_coverage || coverage <= last_coverage))
+            break;
+
+        const double growth = last_time > 0 ? std::max(2.0, (double)solve_time / last_time) : 2.0;
+
+        if (timer.get() + solve_time * growth > budget)
+            break;
+
+        last_time = solve_time;
+        last_coverage = coverage;
+    }
+
+    std::copy(previous.begin(), previous.end(), response);
+
+    spdlog::info("[{}] budgeted calibration used {} of {} samples in {}ms", fx::label, used, bins.samples(), timer.get());
+
+    return true;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,189 @@
+//
+//  tonemap.h
+//  MakeHDR
+//
+//  Created by Vahan Sosoyan 2024.
+//
+
+#ifndef tonemap_h
+#define tonemap_h
+
+#include "resources.h"
+
+#define GRID_PAD 2
+
+
+namespace fx
+{
+    /// Bilateral filter through a downsampled grid (Chen, Paris, Durand 2007). Values are
+    /// splatted into cells of spatial_sigma pixels by range_sigma value units, the grid is
+    /// blurred with a unit gaussian per axis and sliced back with trilinear interpolation,
+    /// so the cost is linear in pixels plus grid cells whatever the spatial kernel size.
+    class bilateral_grid
+    {
+    public:
+        bilateral_grid(const float spatial_sigma, const float range_sigma) : _spatial(std::max(1.f, spatial_sigma)),
+                                                                             _range(std::max(1e-3f, range_sigma))
+        {
+        }
+
+        /// Non-finite values are left out of the grid and pass through unfiltered.
+        void filter(const std::vector<float>& input, const int width, const int height, std::vector<float>& output)
+        {
+            _min = FLT_MAX;
+            float max = -FLT_MAX;
+
+            for (const float value : input)
+            {
+                if (!std::isfinite(value)) continue;
+
+                _min = std::min(_min, value);
+                max = std::max(max, value);
+            }
+
+            if (_min > max)
+                _min = max = 0.f;
+
+            _width = (int)((width - 1) / _spatial) + 1 + 2 * GRID_PAD;
+            _height = (int)((height - 1) / _spatial) + 1 + 2 * GRID_PAD;
+            _depth = (int)((max - _min) / _range) + 1 + 2 * GRID_PAD;
+
+            _cells.assign((size_t)_width * _height * _depth * 2, 0.f);
+            _scratch.assign(_cells.size(), 0.f);
+
+            construct(input, width, height);
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                blur(axis);
+                _cells.swap(_scratch);
+            }
+
+            output.resize(input.size());
+            slice(input, width, height, output);
+        }
+
+    private:
+        size_t cell(const int x, const int y, const int z) const { return (((size_t)y * _width + x) * _depth + z) * 2; }
+
+        /// Nearest cell splat of (value, 1). Threads own disjoint grid rows, so no cell is shared.
+        void construct(const std::vector<float>& input, const int width, const int height)
+        {
+            parallel_rows(_height, [&](int first, int last)
+            {
+                for (int y = std::max(0, (int)((first - GRID_PAD - 1) * _spatial)); y < height; ++y)
+                {
+                    const int gy = (int)(y / _spatial + 0.5f) + GRID_PAD;
+
+                    if (gy < first) continue;
+                    if (gy >= last) break;
+
+                    const float* row = input.data() + (size_t)y * width;
+
+                    for (int x = 0; x < width; ++x)
+                    {
+                        if (!std::isfinite(row[x])) continue;
+
+                        const int gx = (int)(x / _spatial + 0.5f) + GRID_PAD;
+                        const int gz = (int)((row[x] - _min) / _range + 0.5f) + GRID_PAD;
+
+                        float* c = &_cells[cell(gx, gy, gz)];
+                        c[0] += row[x];
+                        c[1] += 1.f;
+                    }
+                }
+            });
+        }
+
+        /// [1 4 6 4 1] / 16 along one axis, from _cells into _scratch.
+        void blur(const int axis)
+        {
+            static const float kernel[5] = { 1.f / 16, 4.f / 16, 6.f / 16, 4.f / 16, 1.f / 16 };
+            const int size = axis == 0 ? _width : axis == 1 ? _height : _depth;
+
+            parallel_rows(_height, [&](int first, int last)
+            {
+                for (int y = first; y < last; ++y)
+                {
+                    for (int x = 0; x < _width; ++x)
+                    {
+                        for (int z = 0; z < _depth; ++z)
+                        {
+                            const int position = axis == 0 ? x : axis == 1 ? y : z;
+                            float value = 0.f, weight = 0.f;
+
+                            for (int k = -2; k <= 2; ++k)
+                            {
+                                const int p = position + k;
+                                if (p < 0 || p >= size) continue;
+
+                                const float* c = &_cells[axis == 0 ? cell(p, y, z) : axis == 1 ? cell(x, p, z) : cell(x, y, p)];
+                                value += kernel[k + 2] * c[0];
+                                weight += kernel[k + 2] * c[1];
+                            }
+
+                            float* out = &_scratch[cell(x, y, z)];
+                            out[0] = value;
+                            out[1] = weight;
+                        }
+                    }
+                }
+            });
+        }
+
+        void slice(const std::vector<float>& input, const int width, const int height, std::vector<float>& output)
+        {
+            parallel_rows(height, [&](int first, int last)
+            {
+                for (int y = first; y < last; ++y)
+                {
+                    const float fy = y / _spatial + GRID_PAD;
+                    const int y0 = (int)fy;
+                    const float ty = fy - y0;
+
+                    for (int x = 0; x < width; ++x)
+                    {
+                        const size_t i = (size_t)y * width + x;
+
+                        if (!std::isfinite(input[i]))
+                        {
+                            output[i] = input[i];
+                            continue;
+                        }
+
+                        const float fx = x / _spatial + GRID_PAD;
+                        const float fz = (input[i] - _min) / _range + GRID_PAD;
+                        const int x0 = (int)fx, z0 = (int)fz;
+                        const float tx = fx - x0, tz = fz - z0;
+
+                        float value = 0.f, weight = 0.f;
+
+                        for (int k = 0; k < 8; ++k)
+                        {
+                            const int dx = k & 1, dy = (k >> 1) & 1, dz = (k >> 2) & 1;
+                            const float w = (dx ? tx : 1.f - tx) * (dy ? ty : 1.f - ty) * (dz ? tz : 1.f - tz);
+                            const float* c = &_cells[cell(x0 + dx, y0 + dy, z0 + dz)];
+
+                            value += w * c[0];
+                            weight += w * c[1];
+                        }
+
+                        output[i] = weight > 0.f ? value / weight : input[i];
+                    }
+                }
+            });
+        }
+
+        float _spatial;
+        float _range;
+        float _min = 0.f;
+        int _width = 0;
+        int _height = 0;
+        int _depth = 0;
+        std::vector<float> _cells;
+        std::vector<float> _scratch;
+    };
+
+}
+
+#endif
@@ -0,0 +1,641 @@
+//
+//  batch.cpp
+//  MakeHDR
+//
+//  Created by Vahan Sosoyan 2024.
+//
+
+#include "solver.h"
+#include "merge.h"
+
+#include "pool.h"
+#include "cache.h"
+#include "../common/image_io.h"
+
+#include <map>
+#include <fstream>
+#include <sstream>
+
+
+/// Batch merge of many bracket sets from a manifest, one set per line:
+///
+///     # output          camera   exposure:image ...
+///     north_01.hdr      a7iii    0.0667:north_01/1.jpg 0.0333:north_01/2.jpg ...
+///
+/// Every set runs decode -> calibrate -> merge -> encode as tasks on a work stealing pool,
+/// so the stages of different sets overlap. Sets are admitted under a global memory cap,
+/// and sets sharing a camera and solver settings share one calibration. Decoded brackets
+/// are kept as planar bin indices, which can be cached on disk and mapped on later runs.
+namespace batch
+{
+    struct options
+    {
+        std::string manifest;
+        int threads = (int)std::max(1u, std::thread::hardware_concurrency());
+        size_t memory = (size_t)4096 << 20;
+        int input_depth = 256;
+        int solver_type = 0;
+        int samples = 100;
+        float smoothness = 50;
+        bool srgb = true;
+        std::string cache;
+    };
+
+    struct bracket_set
+    {
+        int line = 0;
+        std::string output;
+        std::string camera;
+        std::vector<std::string> images;
+        std::vector<float> exp_times;
+        std::vector<float> exp_times_log;
+
+        /// Bins of every source, channel planes back to back, either decoded into storage
+        /// or mapped from the cache.
+        const unsigned char* bins = nullptr;
+        std::vector<unsigned char> storage;
+        mapped_file mapping;
+        std::string cache;
+
+        std::vector<float> result;
+        int width = 0;
+        int height = 0;
+        size_t bytes = 0;
+
+        std::atomic<int> remaining{ 0 };
+        std::atomic<bool> failed{ false };
+        fx::timer timer;
+        double stage_ms[4] = { 0, 0, 0, 0 };
+    };
+
+    /// Response shared by the sets of one camera and solver setting. It is solved from the
+    /// first member in manifest order that decodes, so results do not depend on timing.
+    struct calibration
+    {
+        bool running = false;
+        bool done = false;
+        bool failed = false;
+        std::vector<double> response;
+        std::vector<bracket_set*> members;
+        std::vector<bracket_set*> waiting;
+    };
+
+    /// Zero copy views of the bin planes of every source in a set.
+    template<typename btype>
+    std::vector<std::shared_ptr<fx::bin_planes<btype>>> bin_views(const bracket_set& set, const int depth)
+    {
+        std::vector<std::shared_ptr<fx::bin_planes<btype>>> views;
+        const size_t plane = (size_t)set.width * set.height;
+
+        for (size_t i = 0; i < set.images.size(); ++i)
+        {
+            std::shared_ptr<fx::bin_planes<btype>> view = std::make_shared<fx::bin_planes<btype>>();
+            view->width = set.width;
+            view->height = set.height;
+            view->depth = depth;
+
+            for (int c = 0; c < CMP_MAX; ++c)
+                view->plane[c] = (const btype*)set.bins + (i * CMP_MAX + c) * plane;
+
+            views.push_back(view);
+        }
+
+        return views;
+    }
+
+    enum stage
+    {
+        decode, calibrate, merge, encode
+    };
+
+    class scheduler
+    {
+    public:
+        scheduler(const options& opts) : _opts(opts),
+                                         _pool(opts.threads),
+                                         _budget(opts.memory)
+        {
+            _weights.resize(opts.input_depth);
+
+            for (int i = 0; i < opts.input_depth; ++i)
+                _weights[i] = (float)std::min(i, opts.input_depth - 1 - i);
+
+            _bin_bytes = opts.input_depth > 256 ? 2 : 1;
+        }
+
+        /// Admits every set once the memory cap allows it, then waits for the pipeline to drain.
+        int run(std::vector<std::unique_ptr<bracket_set>>& sets)
+        {
+            fx::timer timer;
+
+            for (std::unique_ptr<bracket_set>& set : sets)
+            {
+                if (!io::jpeg_size(set->images[0], set->width, set->height))
+                {
+                    spdlog::error("[{}] line {}: cannot read {}", fx::label, set->line, set->images[0]);
+                    set->failed = true;
+                    continue;
+                }
+
+                _calibrations[calibration_key(set.get())].members.push_back(set.get());
+            }
+
+            for (std::unique_ptr<bracket_set>& set : sets)
+            {
+                if (set->failed)
+                    continue;
+
+                /// Source bins plus the float RGBA result.
+                set->bytes = (size_t)set->width * set->height * (CMP_MAX * set->images.size() * _bin_bytes + 4 * sizeof(float));
+                _budget.acquire(set->bytes);
+
+                set->timer = fx::timer();
+                start_decode(set.get());
+            }
+
+            _pool.wait_idle();
+
+            int failed = 0;
+            double totals[4] = { 0, 0, 0, 0 };
+
+            for (const std::unique_ptr<bracket_set>& set : sets)
+            {
+                failed += set->failed ? 1 : 0;
+
+                for (int s = 0; s < 4; ++s)
+                    totals[s] += set->stage_ms[s];
+            }
+
+            spdlog::info("[{}] {} sets, {} failed, {} calibrations in {}ms on {} threads", fx::label,
+                sets.size(), failed, _calibrations.size(), timer.get(), _pool.size());
+            spdlog::info("[{}] stage time decode {}ms, calibrate {}ms, merge {}ms, encode {}ms, {} steals, peak memory {}MB", fx::label,
+                (long long)totals[decode], (long long)totals[calibrate], (long long)totals[merge], (long long)totals[encode],
+                _pool.steals(), _budget.peak() >> 20);
+
+            return failed;
+        }
+
+    private:
+        /// Maps the set's cache when it is current, otherwise decodes every source into bins.
+        void start_decode(bracket_set* set)
+        {
+            cache_header header = {};
+            std::vector<cache_source> stamps;
+
+            if (!_opts.cache.empty())
+            {
+                std::memcpy(header.magic, "MHDRBIN", 8);
+                header.version = CACHE_VERSION;
+                header.width = (uint32_t)set->width;
+                header.height = (uint32_t)set->height;
+                header.count = (uint32_t)set->images.size();
+                header.depth = (uint32_t)_opts.input_depth;
+                header.srgb = _opts.srgb ? 1 : 0;
+                header.bin_bytes = (uint32_t)_bin_bytes;
+                header.data_offset = cache_data_offset(set->images.size());
+
+                for (size_t i = 0; i < set->images.size(); ++i)
+                    stamps.push_back(source_stamp(set->images[i], set->exp_times[i]));
+
+                set->cache = _opts.cache + "/" + cache_name(set->output);
+                set->bins = open_cache(set->cache, header, stamps, set->mapping);
+
+                if (set->bins != nullptr)
+                {
+                    spdlog::debug("[{}] {} mapped from {}", fx::label, set->output, set->cache);
+                    _pool.submit([this, set]() { request_calibration(set); });
+                    return;
+                }
+            }
+
+            set->storage.resize((size_t)set->width * set->height * CMP_MAX * set->images.size() * _bin_bytes);
+            set->bins = set->storage.data();
+            set->remaining = (int)set->images.size();
+
+            for (int i = 0; i < (int)set->images.size(); ++i)
+            {
+                _pool.submit([this, set, i, header, stamps]()
+                {
+                    fx::timer timer;
+
+                    const bool decoded = _bin_bytes == 1 ? decode_bins<uint8_t>(set, i) : decode_bins<uint16_t>(set, i);
+
+                    if (!decoded)
+                    {
+                        spdlog::error("[{}] line {}: cannot use {}", fx::label, set->line, set->images[i]);
+                        set->failed = true;
+                    }
+
+                    const bool last = --set->remaining == 0;
+
+                    if (last && !set->failed && !set->cache.empty() && !write_cache(set->cache, header, stamps, set->bins))
+                        spdlog::warn("[{}] cannot write cache {}", fx::label, set->cache);
+
+                    add_time(set, decode, timer.get());
+
+                    if (last)
+                        set->failed ? abandon(set) : request_calibration(set);
+                });
+            }
+        }
+
+        /// Decodes source i straight into its bin planes, quantised like sample_bins::gather.
+        template<typename btype>
+        bool decode_bins(bracket_set* set, const int i)
+        {
+            int width = 0;
+            int height = 0;
+
+            if (!io::jpeg_size(set->images[i], width, height) || width != set->width || height != set->height)
+                return false;
+
+            float values[256];
+            btype lut[256];
+            io::code_values(_opts.srgb, values);
+
+            for (int v = 0; v < 256; ++v)
+                lut[v] = (btype)(std::min(std::max(values[v], 0.f), 1.f) * (_opts.input_depth - 1));
+
+            const size_t plane = (size_t)width * height;
+            btype* planes = (btype*)set->storage.data() + i * CMP_MAX * plane;
+
+            return io::decode_jpeg(set->images[i], [&](const int y, const unsigned char* rgb)
+            {
+                for (int c = 0; c < CMP_MAX; ++c)
+                {
+                    btype* row = planes + c * plane + (size_t)y * width;
+
+                    for (int x = 0; x < width; ++x)
+                        row[x] = lut[rgb[x * 3 + c]];
+                }
+            });
+        }
+
+        /// Cache file name from the output name and a hash of its full path.
+        static std::string cache_name(const std::string& output)
+        {
+            uint64_t hash = 14695981039346656037ull;
+
+            for (const char c : output)
+                hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+
+            const size_t slash = output.find_last_of("/\\");
+            char suffix[32];
+            std::snprintf(suffix, sizeof(suffix), ".%016llx.bins", (unsigned long long)hash);
+
+            return (slash == std::string::npos ? output : output.substr(slash + 1)) + suffix;
+        }
+
+        std::string calibration_key(const bracket_set* set) const
+        {
+            return set->camera + "/" + std::to_string(_opts.input_depth) + "/" + std::to_string(_opts.srgb) + "/" +
+                   std::to_string(_opts.solver_type) + "/" + std::to_string(_opts.samples) + "/" +
+                   std::to_string(_opts.smoothness);
+        }
+
+        /// Merges straight away when the camera is already solved, otherwise waits for the solve.
+        void request_calibration(bracket_set* set)
+        {
+            const std::string key = calibration_key(set);
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            calibration& entry = _calibrations[key];
+
+            if (entry.done)
+            {
+                if (entry.failed)
+                {
+                    set->failed = true;
+                    finish(set);
+                }
+                else
+                    start_merge(set, entry.response);
+
+                return;
+            }
+
+            entry.waiting.push_back(set);
+            try_solve(entry, key);
+        }
+
+        /// A set that failed to decode hands the solve of its camera to the next member.
+        void abandon(bracket_set* set)
+        {
+            const std::string key = calibration_key(set);
+            finish(set);
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            try_solve(_calibrations[key], key);
+        }
+
+        /// Starts the solve once its owner, the first member still standing, has decoded.
+        /// Called with the mutex held.
+        void try_solve(calibration& entry, const std::string& key)
+        {
+            if (entry.running || entry.done)
+                return;
+
+            std::vector<bracket_set*>::iterator owner = std::find_if(entry.members.begin(), entry.members.end(),
+                [](const bracket_set* member) { return !member->failed; });
+
+            if (owner == entry.members.end() || std::find(entry.waiting.begin(), entry.waiting.end(), *owner) == entry.waiting.end())
+                return;
+
+            entry.running = true;
+            bracket_set* set = *owner;
+
+            _pool.submit([this, set, key]()
+            {
+                fx::timer timer;
+                std::vector<double> response(_opts.input_depth * CMP_MAX);
+
+                const bool solved = _bin_bytes == 1
+                    ? solve_bins<uint8_t>(set, response.data())
+                    : solve_bins<uint16_t>(set, response.data());
+
+                add_time(set, calibrate, timer.get());
+
+                if (solved)
+                    spdlog::info("[{}] camera {} calibrated in {}ms", fx::label, set->camera, timer.get());
+                else
+                    spdlog::error("[{}] camera {} calibration failed, its sets are skipped", fx::label, set->camera);
+
+                std::vector<bracket_set*> waiting;
+                const std::vector<double>* shared = nullptr;
+
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    calibration& entry = _calibrations[key];
+                    entry.response.swap(response);
+                    entry.done = true;
+                    entry.failed = !solved;
+                    entry.waiting.swap(waiting);
+                    shared = &entry.response;
+                }
+
+                for (bracket_set* waiter : waiting)
+                {
+                    if (solved)
+                        start_merge(waiter, *shared);
+                    else
+                    {
+                        waiter->failed = true;
+                        finish(waiter);
+                    }
+                }
+            });
+        }
+
+        /// False when the solve was cancelled or a channel was left unsolved, which solvers
+        /// report by leaving its curve untouched at zero, or returned non-finite values.
+        template<typename btype>
+        bool solve_bins(bracket_set* set, double* response)
+        {
+            const std::vector<fx::point> points = sample_grid(set->width, set->height, _opts.samples, _opts.solver_type);
+            const std::vector<std::shared_ptr<fx::bin_planes<btype>>> views = bin_views<btype>(*set, _opts.input_depth);
+
+            sample_bins bins((int)views.size(), (int)points.size(), _opts.input_depth);
+            for (int i = 0; i < (int)views.size(); ++i)
+                bins.gather(i, *views[i], points);
+
+            if (!solve_channels(_opts.solver_type, _opts.input_depth, _opts.smoothness, bins, set->exp_times,
+                                set->exp_times_log, _weights, nullptr, response, fx::cancel_token(), nullptr))
+                return false;
+
+            for (int c = 0; c < CMP_MAX; ++c)
+            {
+                const double* curve = response + _opts.input_depth * c;
+                bool solved = false;
+
+                for (int i = 0; i < _opts.input_depth; ++i)
+                {
+                    if (!std::isfinite(curve[i]))
+                        return false;
+
+                    solved |= curve[i] != 0.0;
+                }
+
+                if (!solved)
+                    return false;
+            }
+
+            return true;
+        }
+
+        /// Splits the merge into row bands so idle workers can steal parts of a large set.
+        void start_merge(bracket_set* set, const std::vector<double>& response)
+        {
+            std::shared_ptr<fx::merge_tables> tables = std::make_shared<fx::merge_tables>();
+            tables->set(_opts.input_depth, _weights, response.data(), false);
+
+            const int darkest = (int)(std::min_element(set->exp_times_log.begin(), set->exp_times_log.end()) - set->exp_times_log.begin());
+            const int bands = std::min(set->height, _pool.size() * 4);
+            const int band = (set->height + bands - 1) / bands;
+
+            set->result.resize((size_t)set->width * set->height * 4);
+            set->remaining = (set->height + band - 1) / band;
+
+            for (int first = 0; first < set->height; first += band)
+            {
+                _pool.submit([this, set, tables, darkest, first, band]()
+                {
+                    fx::timer timer;
+                    const int last = std::min(set->height, first + band);
+
+                    if (_bin_bytes == 1)
+                        merge_rows<uint8_t>(set, *tables, darkest, first, last);
+                    else
+                        merge_rows<uint16_t>(set, *tables, darkest, first, last);
+
+                    add_time(set, merge, timer.get());
+
+                    if (--set->remaining == 0)
+                        start_encode(set);
+                });
+            }
+        }
+
+        template<typename btype>
+        void merge_rows(bracket_set* set, const fx::merge_tables& tables, const int darkest, const int first, const int last)
+        {
+            const std::vector<std::shared_ptr<fx::bin_planes<btype>>> views = bin_views<btype>(*set, _opts.input_depth);
+            fx::merge_block block;
+
+            for (int y = first; y < last; ++y)
+            {
+                for (int x = 0; x < set->width; x += MERGE_BLOCK)
+                {
+                    block.clear(std::min(MERGE_BLOCK, set->width - x));
+
+                    for (int i = 0; i < (int)views.size(); ++i)
+                    {
+                        const btype* rows[CMP_MAX];
+
+                        for (int c = 0; c < CMP_MAX; ++c)
+                            rows[c] = views[i]->row(y, c) + x;
+
+                        fx::merge_bins(tables, rows, set->exp_times_log[i], i == darkest, 0, block.size, block);
+                    }
+
+                    fx::merge_resolve(block, 1.f, 4, &set->result[((size_t)y * set->width + x) * 4]);
+                }
+            }
+        }
+
+        void start_encode(bracket_set* set)
+        {
+            /// Sources are no longer needed, give their memory back before writing.
+            release_bins(set);
+
+            _pool.submit([this, set]()
+            {
+                fx::timer timer;
+
+                if (!io::write_image(set->output, set->result.data(), set->width, set->height, 4, false))
+                {
+                    spdlog::error("[{}] line {}: cannot write {}", fx::label, set->line, set->output);
+                    set->failed = true;
+                }
+
+                add_time(set, encode, timer.get());
+                finish(set);
+            });
+        }
+
+        void finish(bracket_set* set)
+        {
+            release_bins(set);
+            std::vector<float>().swap(set->result);
+
+            if (!set->failed)
+                spdlog::info("[{}] {} done in {}ms", fx::label, set->output, set->timer.get());
+
+            _budget.release(set->bytes);
+        }
+
+        void release_bins(bracket_set* set)
+        {
+            set->bins = nullptr;
+            std::vector<unsigned char>().swap(set->storage);
+            set->mapping.close();
+        }
+
+        void add_time(bracket_set* set, const stage s, const long long ms)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            set->stage_ms[s] += (double)ms;
+        }
+
+        const options& _opts;
+        task_pool _pool;
+        memory_budget _budget;
+        std::vector<float> _weights;
+        int _bin_bytes = 1;
+        std::map<std::string, calibration> _calibrations;
+        std::mutex _mutex;
+    };
+
+    bool read_manifest(const std::string& path, std::vector<std::unique_ptr<bracket_set>>& sets)
+    {
+        std::ifstream file(path);
+
+        if (!file)
+            return false;
+
+        const size_t slash = path.find_last_of("/\\");
+        const std::string directory = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+        auto resolve = [&](const std::string& name) { return name.empty() || name[0] == '/' ? name : directory + name; };
+
+        std::string line;
+        for (int number = 1; std::getline(file, line); ++number)
+        {
+            std::istringstream stream(line);
+            std::unique_ptr<bracket_set> set(new bracket_set());
+            std::string entry;
+
+            if (!(stream >> set->output) || set->output[0] == '#')
+                continue;
+
+            set->line = number;
+            set->output = resolve(set->output);
+            stream >> set->camera;
+
+            while (stream >> entry)
+            {
+                const size_t split = entry.find(':');
+                const float exp_time = split == std::string::npos ? 0.f : (float)std::atof(entry.substr(0, split).c_str());
+
+                if (exp_time <= 0.f)
+                {
+                    spdlog::error("[{}] line {}: expected exposure:image, got {}", fx::label, number, entry);
+                    return false;
+                }
+
+                set->images.push_back(resolve(entry.substr(split + 1)));
+                set->exp_times.push_back(exp_time);
+                set->exp_times_log.push_back(std::log(exp_time));
+            }
+
+            if (set->images.size() < 2)
+            {
+                spdlog::error("[{}] line {}: a set needs at least two brackets", fx::label, number);
+                return false;
+            }
+
+            sets.push_back(std::move(set));
+        }
+
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    batch::options opts;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+
+        if (arg == "--threads" && has_value) opts.threads = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--memory" && has_value) opts.memory = (size_t)std::max(1ull, std::strtoull(argv[++i], nullptr, 10)) << 20;
+        else if (arg == "--depth" && has_value) opts.input_depth = 1 << std::max(8, std::min(12, std::atoi(argv[++i])));
+        else if (arg == "--solver" && has_value) opts.solver_type = std::max(0, std::min(3, std::atoi(argv[++i])));
+        else if (arg == "--samples" && has_value) opts.samples = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--smoothness" && has_value) opts.smoothness = (float)std::atof(argv[++i]);
+        else if (arg == "--raw") opts.srgb = false;
+        else if (arg == "--cache" && has_value) opts.cache = argv[++i];
+        else if (arg == "--verbose") spdlog::set_level(spdlog::level::debug);
+        else if (opts.manifest.empty() && arg[0] != '-') opts.manifest = arg;
+        else opts.manifest.clear(), i = argc;
+    }
+
+    if (opts.manifest.empty())
+    {
+        std::printf("usage: make_hdr_batch <manifest> [options]\n"
+                    "  --threads n       worker threads, default hardware concurrency\n"
+                    "  --memory mb       cap on memory held by sets in flight, default 4096\n"
+                    "  --depth bits      response depth 8, 10 or 12, default 8\n"
+                    "  --solver n        0 debevec, 1 robertson, 2 debevec iterative,\n"
+                    "                    3 debevec mixed precision, default 0\n"
+                    "  --samples n       calibration samples, default 100\n"
+                    "  --smoothness f    debevec smoothness or robertson iterations, default 50\n"
+                    "  --raw             use jpeg code values instead of linearised sRGB\n"
+                    "  --cache dir       keep decoded brackets in dir and map them on later runs\n"
+                    "  --verbose         debug logging\n"
+                    "manifest lines: <output.hdr|.pfm> <camera> <exposure>:<image> ...\n");
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<batch::bracket_set>> sets;
+
+    if (!batch::read_manifest(opts.manifest, sets))
+    {
+        spdlog::error("[{}] cannot read manifest {}", fx::label, opts.manifest);
+        return 1;
+    }
+
+    batch::scheduler scheduler(opts);
+    return scheduler.run(sets) > 0 ? 2 : 0;
+}
@@ -0,0 +1,223 @@
+//
+//  cache.h
+//  MakeHDR
+//
+//  Created by Vahan Sosoyan 2024.
+//
+
+#ifndef cache_h
+#define cache_h
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define CACHE_VERSION 1
+#define CACHE_ALIGN 4096
+
+
+/// Pre-decoded bracket set on disk, read back through mmap without copies:
+///
+///     cache_header
+///     cache_source[count]        exposure and the size / mtime of the jpeg it came from
+///     padding to CACHE_ALIGN
+///     bins[count][CMP_MAX][height][width]   uint8 up to depth 256, uint16 above
+///
+/// Bins are quantised exactly like sample_bins::gather, so solving and merging from the
+/// cache matches solving and merging the decoded floats.
+namespace batch
+{
+    struct cache_header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        uint32_t count;
+        uint32_t depth;
+        uint32_t srgb;
+        uint32_t bin_bytes;
+        uint32_t reserved;
+        uint64_t data_offset;
+    };
+
+    struct cache_source
+    {
+        float exposure;
+        uint32_t reserved;
+        uint64_t file_size;
+        int64_t file_mtime;
+    };
+
+    /// Identifies the jpeg a cache entry was decoded from, so edited sources invalidate it.
+    inline cache_source source_stamp(const std::string& path, const float exposure)
+    {
+        cache_source source = {};
+        struct stat info;
+
+        source.exposure = exposure;
+
+        if (stat(path.c_str(), &info) == 0)
+        {
+            source.file_size = (uint64_t)info.st_size;
+            source.file_mtime = (int64_t)info.st_mtime;
+        }
+
+        return source;
+    }
+
+    /// Read only memory map of a whole file.
+    class mapped_file
+    {
+    public:
+        mapped_file() = default;
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        ~mapped_file()
+        {
+            close();
+        }
+
+        bool open(const std::string& path)
+        {
+            close();
+
+#ifdef _WIN32
+            HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+            if (file == INVALID_HANDLE_VALUE)
+                return false;
+
+            LARGE_INTEGER size;
+            GetFileSizeEx(file, &size);
+            HANDLE mapping = size.QuadPart > 0 ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+            CloseHandle(file);
+
+            if (mapping == nullptr)
+                return false;
+
+            _data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+            _size = (size_t)size.QuadPart;
+#else
+            const int file = ::open(path.c_str(), O_RDONLY);
+
+            if (file < 0)
+                return false;
+
+            struct stat info;
+            void* data = fstat(file, &info) == 0 && info.st_size > 0
+                ? mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, file, 0)
+                : MAP_FAILED;
+            ::close(file);
+
+            if (data == MAP_FAILED)
+                return false;
+
+            _data = (const unsigned char*)data;
+            _size = (size_t)info.st_size;
+#endif
+            return _data != nullptr;
+        }
+
+        void close()
+        {
+            if (_data == nullptr)
+                return;
+
+#ifdef _WIN32
+            UnmapViewOfFile(_data);
+#else
+            munmap((void*)_data, _size);
+#endif
+            _data = nullptr;
+            _size = 0;
+        }
+
+        const unsigned char* data() const { return _data; }
+        size_t size() const { return _size; }
+
+    private:
+        const unsigned char* _data = nullptr;
+        size_t _size = 0;
+    };
+
+    inline size_t cache_data_offset(const size_t count)
+    {
+        const size_t meta = sizeof(cache_header) + count * sizeof(cache_source);
+        return (meta + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+    }
+
+    /// Writes next to the final path and renames, so readers never map a partial file.
+    inline bool write_cache(const std::string& path,
+                            const cache_header& header,
+                            const std::vector<cache_source>& sources,
+                            const unsigned char* bins)
+    {
+        const std::string temporary = path + ".tmp";
+        FILE* file = std::fopen(temporary.c_str(), "wb");
+
+        if (file == nullptr)
+            return false;
+
+        const size_t bytes = (size_t)header.width * header.height * header.count * 3 * header.bin_bytes;
+        const std::vector<char> padding(header.data_offset - sizeof(cache_header) - sources.size() * sizeof(cache_source), 0);
+
+        bool written = std::fwrite(&header, sizeof(header), 1, file) == 1;
+        written = written && std::fwrite(sources.data(), sizeof(cache_source), sources.size(), file) == sources.size();
+        written = written && std::fwrite(padding.data(), 1, padding.size(), file) == padding.size();
+        written = written && std::fwrite(bins, 1, bytes, file) == bytes;
+        written = std::fclose(file) == 0 && written;
+
+        std::remove(path.c_str());
+
+        if (!written || std::rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            std::remove(temporary.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    /// Maps a cache and returns its bins when it matches the expected header and sources
+    /// exactly, nullptr when it is missing, stale or built with other settings.
+    inline const unsigned char* open_cache(const std::string& path,
+                                           const cache_header& expected,
+                                           const std::vector<cache_source>& sources,
+                                           mapped_file& mapping)
+    {
+        if (!mapping.open(path) || mapping.size() < sizeof(cache_header))
+            return nullptr;
+
+        const cache_header& header = *(const cache_header*)mapping.data();
+        const size_t bytes = (size_t)header.width * header.height * header.count * 3 * header.bin_bytes;
+
+        const bool valid = std::memcmp(&header, &expected, sizeof(cache_header)) == 0 &&
+                           mapping.size() >= header.data_offset + bytes &&
+                           std::memcmp(mapping.data() + sizeof(cache_header), sources.data(), sources.size() * sizeof(cache_source)) == 0;
+
+        if (!valid)
+        {
+            mapping.close();
+            return nullptr;
+        }
+
+        return mapping.data() + header.data_offset;
+    }
+}
+
+#endif
@@ -0,0 +1,213 @@
+//
+//  pool.h
+//  MakeHDR
+//
+//  Created by Vahan Sosoyan 2024.
+//
+
+#ifndef pool_h
+#define pool_h
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+
+namespace batch
+{
+    /// Work stealing thread pool. Every worker owns a deque: tasks it submits go to the
+    /// back of its own deque and it pops from the back, so a pipeline stage usually runs
+    /// its continuation while the data is still in cache. Idle workers steal from the
+    /// front of the other deques, taking the oldest work first.
+    class task_pool
+    {
+    public:
+        typedef std::function<void()> task;
+
+        explicit task_pool(const int threads)
+        {
+            const int count = std::max(1, threads);
+
+            for (int i = 0; i < count; ++i)
+                _queues.push_back(std::unique_ptr<queue>(new queue()));
+
+            for (int i = 0; i < count; ++i)
+                _threads.push_back(std::thread([this, i]() { work(i); }));
+        }
+
+        ~task_pool()
+        {
+            wait_idle();
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+
+            _wake.notify_all();
+
+            for (std::thread& thread : _threads)
+                thread.join();
+        }
+
+        /// Queues on the calling worker, or round robin when called from outside the pool.
+        void submit(task work)
+        {
+            const int index = worker_index() >= 0 ? worker_index() : (int)(_next++ % _queues.size());
+
+            ++_pending;
+
+            {
+                std::lock_guard<std::mutex> lock(_queues[index]->mutex);
+                _queues[index]->tasks.push_back(std::move(work));
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                ++_available;
+            }
+
+            _wake.notify_one();
+        }
+
+        /// Blocks until every submitted task, including the ones they submit, has finished.
+        void wait_idle()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _idle.wait(lock, [this]() { return _pending == 0; });
+        }
+
+        int size() const { return (int)_threads.size(); }
+        long long steals() const { return _steals; }
+
+    private:
+        struct queue
+        {
+            std::mutex mutex;
+            std::deque<task> tasks;
+        };
+
+        static int& worker_index()
+        {
+            static thread_local int index = -1;
+            return index;
+        }
+
+        bool pop(const int index, task& work)
+        {
+            {
+                queue& own = *_queues[index];
+                std::lock_guard<std::mutex> lock(own.mutex);
+
+                if (!own.tasks.empty())
+                {
+                    work = std::move(own.tasks.back());
+                    own.tasks.pop_back();
+                    return true;
+                }
+            }
+
+            for (size_t i = 1; i < _queues.size(); ++i)
+            {
+                queue& other = *_queues[(index + i) % _queues.size()];
+                std::lock_guard<std::mutex> lock(other.mutex);
+
+                if (!other.tasks.empty())
+                {
+                    work = std::move(other.tasks.front());
+                    other.tasks.pop_front();
+                    ++_steals;
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        void work(const int index)
+        {
+            worker_index() = index;
+
+            for (;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    _wake.wait(lock, [this]() { return _stop || _available > 0; });
+
+                    if (_stop && _available == 0)
+                        return;
+
+                    --_available;
+                }
+
+                task work;
+
+                /// A task counted as available is in some deque until it is taken.
+                while (!pop(index, work))
+                    std::this_thread::yield();
+
+                work();
+
+                std::lock_guard<std::mutex> lock(_mutex);
+
+                if (--_pending == 0)
+                    _idle.notify_all();
+            }
+        }
+
+        std::vector<std::unique_ptr<queue>> _queues;
+        std::vector<std::thread> _threads;
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        std::condition_variable _idle;
+        std::atomic<int> _pending{ 0 };
+        std::atomic<unsigned int> _next{ 0 };
+        std::atomic<long long> _steals{ 0 };
+        int _available = 0;
+        bool _stop = false;
+    };
+
+    /// Global cap on bytes held by sets in flight. A request larger than the cap is
+    /// admitted alone, so a single oversized set cannot stall the batch.
+    class memory_budget
+    {
+    public:
+        explicit memory_budget(const size_t cap) : _cap(cap)
+        {
+        }
+
+        void acquire(const size_t bytes)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _released.wait(lock, [&]() { return _used == 0 || _used + bytes <= _cap; });
+            _used += bytes;
+            _peak = std::max(_peak, _used);
+        }
+
+        void release(const size_t bytes)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _used -= bytes;
+            }
+
+            _released.notify_all();
+        }
+
+        size_t peak() const { return _peak; }
+
+    private:
+        size_t _cap;
+        size_t _used = 0;
+        size_t _peak = 0;
+        std::mutex _mutex;
+        std::condition_variable _released;
+    };
+}
+
+#endif
@@ -0,0 +1,525 @@
+//
+//  bench.cpp
+//  MakeHDR
+//
+//  Created by Vahan Sosoyan 2024.
+//
+
+#include "host.h"
+#include "../common/image_io.h"
+
+#include <cmath>
+#include <algorithm>
+
+
+namespace bench
+{
+    struct options
+    {
+        std::string plugin;
+        std::string identifier = "net.sf.openfx.make_hdr";
+        std::vector<std::string> images;
+        std::vector<double> times;
+        std::vector<std::pair<std::string, std::string>> values;
+        std::vector<std::pair<std::string, std::string>> compare;
+        std::vector<int> window;
+        double tolerance = 1e-4;
+        std::string output;
+        int frames = 1;
+        int frame_threads = 1;
+        int await_calibration = 0;
+        unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+        bool srgb = true;
+    };
+
+    /// Result of one timed render.
+    struct render_report
+    {
+        double time = 0;
+        double total_ms = 0;
+        double pre_ms = 0;
+        double threads_ms = 0;
+        double post_ms = 0;
+        double fetch_ms = 0;
+        unsigned long long checksum = 0;
+        double mean[3] = { 0, 0, 0 };
+        std::shared_ptr<frame> output;
+        OfxStatus status = kOfxStatOK;
+    };
+
+    void usage()
+    {
+        std::printf("usage: make_hdr_bench <plugin.ofx | plugin.ofx.bundle> [options] <image.jpg>...\n"
+                    "  --times t1,t2,...     exposure times in seconds per image, default 1/15 halving per image\n"
+                    "  --frames n            frames to render, default 1\n"
+                    "  --threads n           host threads per render, default hardware concurrency\n"
+                    "  --frame-threads n     frames rendered concurrently, one instance each, default 1\n"
+                    "  --set name=value      parameter value, repeatable, e.g. --set solver=1\n"
+                    "  --await-calibration ms  after the frames, wait for the plugin to set a parameter, as a\n"
+                    "                        finished background calibration does, then render frame 0 again\n"
+                    "  --window x1,y1,x2,y2  render window, default the whole frame\n"
+                    "  --compare name=value  render frame 0 again on a new instance with this value too, repeatable,\n"
+                    "                        and fail when the two outputs differ by more than the tolerance\n"
+                    "  --tolerance e         largest difference --compare accepts, default 1e-4\n"
+                    "  --raw                 feed jpeg code values instead of linearised sRGB\n"
+                    "  --output file.pfm     write the last rendered frame, .pfm or .hdr\n"
+                    "  --plugin-id id        plugin identifier, default net.sf.openfx.make_hdr\n");
+    }
+
+    bool parse(int argc, char** argv, options& opts)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            const bool has_value = i + 1 < argc;
+
+            if ((arg == "--times" || arg == "--window") && has_value)
+            {
+                std::string list = argv[++i];
+                for (size_t start = 0, end; start < list.size(); start = end + 1)
+                {
+                    end = list.find(',', start);
+                    if (end == std::string::npos) end = list.size();
+
+                    if (arg == "--times")
+                        opts.times.push_back(std::atof(list.substr(start, end - start).c_str()));
+                    else
+                        opts.window.push_back(std::atoi(list.substr(start, end - start).c_str()));
+                }
+
+                if (arg == "--window" && opts.window.size() != 4)
+                    return false;
+            }
+            else if (arg == "--frames" && has_value) opts.frames = std::max(1, std::atoi(argv[++i]));
+            else if (arg == "--threads" && has_value) opts.threads = (unsigned int)std::max(1, std::atoi(argv[++i]));
+            else if (arg == "--frame-threads" && has_value) opts.frame_threads = std::max(1, std::atoi(argv[++i]));
+            else if (arg == "--await-calibration" && has_value) opts.await_calibration = std::max(0, std::atoi(argv[++i]));
+            else if (arg == "--tolerance" && has_value) opts.tolerance = std::atof(argv[++i]);
+            else if (arg == "--output" && has_value) opts.output = argv[++i];
+            else if (arg == "--plugin-id" && has_value) opts.identifier = argv[++i];
+            else if (arg == "--raw") opts.srgb = false;
+            else if ((arg == "--set" || arg == "--compare") && has_value)
+            {
+                const std::string value = argv[++i];
+                const size_t split = value.find('=');
+
+                if (split == std::string::npos)
+                    return false;
+
+                (arg == "--set" ? opts.values : opts.compare).push_back(std::make_pair(value.substr(0, split), value.substr(split + 1)));
+            }
+            else if (arg == "--help" || arg == "-h") return false;
+            else if (opts.plugin.empty()) opts.plugin = arg;
+            else opts.images.push_back(arg);
+        }
+
+        if (opts.plugin.empty() || opts.images.empty())
+            return false;
+
+        if (opts.times.empty())
+        {
+            for (int i = 0; i < (int)opts.images.size(); ++i)
+                opts.times.push_back(1.0 / 15.0 / std::pow(2.0, i));
+        }
+
+        return opts.times.size() == opts.images.size();
+    }
+
+    /// FNV-1a over the raw output float words, identical renders give identical sums.
+    unsigned long long checksum(const frame& image)
+    {
+        unsigned long long hash = 14695981039346656037ull;
+
+        for (const float value : image.pixels)
+        {
+            uint32_t word;
+            std::memcpy(&word, &value, sizeof(word));
+
+            hash ^= word;
+            hash *= 1099511628211ull;
+        }
+
+        return hash;
+    }
+
+    inline bool succeeded(const OfxStatus status) { return status == kOfxStatOK || status == kOfxStatReplyDefault; }
+
+    bool apply_value(image_effect& instance, const std::string& name, const std::string& value)
+    {
+        param* p = instance.params.find(name);
+
+        if (p == nullptr)
+        {
+            std::fprintf(stderr, "[host] unknown parameter %s\n", name.c_str());
+            return false;
+        }
+
+        if (p->is_string())
+        {
+            p->text = value;
+            return true;
+        }
+
+        p->values.assign(p->count(), 0.0);
+
+        size_t start = 0;
+        for (int i = 0; i < p->count() && start <= value.size(); ++i)
+        {
+            size_t end = value.find(',', start);
+            if (end == std::string::npos) end = value.size();
+
+            const std::string item = value.substr(start, end - start);
+            p->values[i] = item == "true" ? 1.0 : item == "false" ? 0.0 : std::atof(item.c_str());
+
+            if (end == value.size() && i == 0)
+                std::fill(p->values.begin(), p->values.end(), p->values[0]);
+
+            start = end + 1;
+        }
+
+        return true;
+    }
+
+    /// Renders one frame into a new output of the source size, only the window when one is given.
+    render_report render_frame(plugin& host,
+                               image_effect& instance,
+                               const double time,
+                               const int width,
+                               const int height,
+                               const std::vector<int>& window)
+    {
+        render_record record;
+        record.time = time;
+        record.output = std::make_shared<frame>();
+        record.output->width = width;
+        record.output->height = height;
+        record.output->pixels.assign((size_t)width * height * 4, 0.f);
+
+        property_set args;
+        args.set_double(kOfxPropTime, 0, time);
+        args.set_string(kOfxImageEffectPropFieldToRender, 0, kOfxImageFieldNone);
+        args.set_ints(kOfxImageEffectPropRenderWindow, window.size() == 4 ? window : std::vector<int>{ 0, 0, width, height });
+        args.set_doubles(kOfxImageEffectPropRenderScale, { 1.0, 1.0 });
+        args.set_int(kOfxImageEffectPropSequentialRenderStatus, 0, 0);
+        args.set_int(kOfxImageEffectPropInteractiveRenderStatus, 0, 0);
+        args.set_int(kOfxImageEffectPropRenderQualityDraft, 0, 0);
+
+        current_record() = &record;
+        record.begin = clock::now();
+
+        const OfxStatus status = host.action(kOfxImageEffectActionRender, &instance, &args);
+
+        record.end = clock::now();
+        current_record() = nullptr;
+
+        render_report report;
+        report.time = time;
+        report.status = status;
+        report.total_ms = elapsed_ms(record.begin, record.end);
+        report.fetch_ms = record.fetch_ms;
+        report.threads_ms = record.threads_ms;
+
+        if (record.thread_calls > 0)
+        {
+            report.pre_ms = elapsed_ms(record.begin, record.first_thread);
+            report.post_ms = elapsed_ms(record.last_thread, record.end);
+        }
+
+        report.checksum = checksum(*record.output);
+
+        const size_t count = (size_t)width * height;
+        for (size_t i = 0; i < count; ++i)
+            for (int c = 0; c < 3; ++c)
+                report.mean[c] += record.output->pixels[i * 4 + c];
+
+        for (int c = 0; c < 3; ++c)
+            report.mean[c] /= std::max<size_t>(count, 1);
+
+        report.output = record.output;
+        return report;
+    }
+
+    /// Parameter values the plugin has set since the instance was created, the way it asks
+    /// an interactive host for a re-render.
+    unsigned int param_writes(image_effect& instance)
+    {
+        unsigned int writes = 0;
+
+        for (const std::unique_ptr<param>& p : instance.params.params)
+            writes += p->writes;
+
+        return writes;
+    }
+
+    /// Waits up to timeout ms for the plugin to set a parameter after the given count of writes
+    /// and renders the first frame again, as a host re-rendering on that change would. Fails
+    /// when the plugin never asks, or when the second render matches the first, the result
+    /// not having been picked up.
+    bool await_rerender(plugin& host,
+                        image_effect& instance,
+                        const unsigned int writes,
+                        const render_report& first,
+                        const int timeout,
+                        const int width,
+                        const int height,
+                        const std::vector<int>& window)
+    {
+        const clock::time_point begin = clock::now();
+
+        while (param_writes(instance) == writes && elapsed_ms(begin, clock::now()) < timeout)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+        const double waited = elapsed_ms(begin, clock::now());
+
+        if (param_writes(instance) == writes)
+        {
+            std::printf("\nno re-render requested within %d ms\n", timeout);
+            return false;
+        }
+
+        const render_report again = render_frame(host, instance, first.time, width, height, window);
+        const bool changed = again.checksum != first.checksum;
+
+        std::printf("\nre-render requested after %.2f ms, frame %g %016llx -> %016llx  %.5f %.5f %.5f%s\n",
+                    waited, first.time, first.checksum, again.checksum, again.mean[0], again.mean[1], again.mean[2],
+                    changed ? "" : "  UNCHANGED");
+
+        return changed && succeeded(again.status);
+    }
+
+    /// Instance with the sources connected and the given values set before creation.
+    std::unique_ptr<image_effect> create_instance(plugin& host,
+                                                  image_effect& descriptor,
+                                                  const std::vector<std::shared_ptr<frame>>& sources,
+                                                  const options& opts,
+                                                  const std::vector<std::pair<std::string, std::string>>& values)
+    {
+        std::unique_ptr<image_effect> instance = instantiate(descriptor);
+
+        for (int i = 0; i < (int)sources.size(); ++i)
+        {
+            clip* source = instance->find_clip("src" + std::to_string(i + 1));
+
+            if (source == nullptr)
+            {
+                std::fprintf(stderr, "[host] plugin has fewer than %d source clips\n", i + 1);
+                return nullptr;
+            }
+
+            source->source = sources[i];
+            source->props.set_int(kOfxImageClipPropConnected, 0, 1);
+            apply_value(*instance, "src" + std::to_string(i + 1), std::to_string(opts.times[i]));
+        }
+
+        for (const std::pair<std::string, std::string>& value : values)
+        {
+            if (!apply_value(*instance, value.first, value.second))
+                return nullptr;
+        }
+
+        if (!succeeded(host.action(kOfxActionCreateInstance, instance.get())))
+        {
+            std::fprintf(stderr, "[host] create instance failed\n");
+            return nullptr;
+        }
+
+        return instance;
+    }
+
+    /// Renders the first frame again on a new instance with the compare values on top of the
+    /// others, and fails when any output channel differs from the first render by more than
+    /// the tolerance, e.g. two code paths that should produce the same image.
+    bool compare_render(plugin& host,
+                        image_effect& descriptor,
+                        const std::vector<std::shared_ptr<frame>>& sources,
+                        const options& opts,
+                        const render_report& first)
+    {
+        std::vector<std::pair<std::string, std::string>> values = opts.values;
+        values.insert(values.end(), opts.compare.begin(), opts.compare.end());
+
+        std::unique_ptr<image_effect> instance = create_instance(host, descriptor, sources, opts, values);
+
+        if (!instance)
+            return false;
+
+        const render_report again = render_frame(host, *instance, first.time, sources[0]->width, sources[0]->height, opts.window);
+        host.action(kOfxActionDestroyInstance, instance.get());
+
+        double difference = 0;
+        for (size_t i = 0; i < first.output->pixels.size(); ++i)
+            difference = std::max(difference, (double)std::fabs(first.output->pixels[i] - again.output->pixels[i]));
+
+        const bool matched = difference <= opts.tolerance;
+
+        std::printf("\ncompare frame %g %016llx -> %016llx  %.5f %.5f %.5f  max difference %g%s\n",
+                    first.time, first.checksum, again.checksum, again.mean[0], again.mean[1], again.mean[2],
+                    difference, matched ? "" : "  MISMATCH");
+
+        return matched && succeeded(again.status);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    using namespace bench;
+
+    options opts;
+
+    if (!parse(argc, argv, opts))
+    {
+        usage();
+        return 1;
+    }
+
+    host_settings().threads = opts.threads;
+
+    clock::time_point stage = clock::now();
+    auto lap = [&]()
+    {
+        const clock::time_point now = clock::now();
+        const double ms = elapsed_ms(stage, now);
+        stage = now;
+        return ms;
+    };
+
+    std::vector<std::shared_ptr<frame>> sources;
+    for (const std::string& path : opts.images)
+    {
+        std::shared_ptr<frame> source = std::make_shared<frame>();
+
+        if (io::read_jpeg(path, opts.srgb, 4, true, source->pixels, source->width, source->height))
+            sources.push_back(source);
+
+        if (sources.empty() || sources.back() != source || sources.back()->width != sources.front()->width || sources.back()->height != sources.front()->height)
+        {
+            std::fprintf(stderr, "[host] cannot use %s\n", path.c_str());
+            return 1;
+        }
+    }
+    std::printf("decode            %9.2f ms  %d images %dx%d\n", lap(), (int)sources.size(), sources[0]->width, sources[0]->height);
+
+    plugin host;
+    if (!host.load(opts.plugin, opts.identifier))
+        return 1;
+
+    if (!succeeded(host.action(kOfxActionLoad, nullptr)))
+    {
+        std::fprintf(stderr, "[host] load action failed\n");
+        return 1;
+    }
+    std::printf("load              %9.2f ms\n", lap());
+
+    image_effect descriptor;
+    descriptor.props.set_string(kOfxPropType, 0, kOfxTypeImageEffect);
+
+    property_set context;
+    context.set_string(kOfxImageEffectPropContext, 0, kOfxImageEffectContextGeneral);
+
+    if (!succeeded(host.action(kOfxActionDescribe, &descriptor)) ||
+        !succeeded(host.action(kOfxImageEffectActionDescribeInContext, &descriptor, &context)))
+    {
+        std::fprintf(stderr, "[host] describe failed\n");
+        return 1;
+    }
+    std::printf("describe          %9.2f ms  %d clips %d params\n", lap(), (int)descriptor.clips.size(), (int)descriptor.params.params.size());
+
+    /// Instance safe plugins get one instance per frame thread, unsafe ones are serialised.
+    const std::string safety = descriptor.props.get_string(kOfxImageEffectPluginRenderThreadSafety);
+    if (safety == kOfxImageEffectRenderUnsafe)
+        opts.frame_threads = 1;
+
+    std::vector<std::unique_ptr<image_effect>> instances;
+    for (int t = 0; t < opts.frame_threads; ++t)
+    {
+        std::unique_ptr<image_effect> instance = create_instance(host, descriptor, sources, opts, opts.values);
+
+        if (!instance)
+            return 1;
+
+        instances.push_back(std::move(instance));
+    }
+    std::printf("create instance   %9.2f ms  %d instances, %s, %u threads each\n", lap(), (int)instances.size(), safety.c_str(), opts.threads);
+
+    std::vector<render_report> reports(opts.frames);
+    std::atomic<int> next(0);
+
+    const unsigned int writes = param_writes(*instances[0]);
+
+    const clock::time_point wall_begin = clock::now();
+
+    std::vector<std::thread> frame_threads;
+    for (int t = 0; t < (int)instances.size(); ++t)
+    {
+        frame_threads.push_back(std::thread([&, t]()
+        {
+            image_effect& instance = *instances[t];
+
+            property_set sequence;
+            sequence.set_doubles(kOfxImageEffectPropFrameRange, { 0.0, (double)opts.frames - 1 });
+            sequence.set_double(kOfxImageEffectPropFrameStep, 0, 1.0);
+            sequence.set_int(kOfxPropIsInteractive, 0, 0);
+            sequence.set_doubles(kOfxImageEffectPropRenderScale, { 1.0, 1.0 });
+            sequence.set_int(kOfxImageEffectPropSequentialRenderStatus, 0, 0);
+            sequence.set_int(kOfxImageEffectPropInteractiveRenderStatus, 0, 0);
+
+            host.action(kOfxImageEffectActionBeginSequenceRender, &instance, &sequence);
+
+            for (int f = next++; f < opts.frames; f = next++)
+            {
+                reports[f] = render_frame(host, instance, (double)f, sources[0]->width, sources[0]->height, opts.window);
+
+                if (f != 0 && f + 1 < opts.frames)
+                    reports[f].output.reset();
+            }
+
+            host.action(kOfxImageEffectActionEndSequenceRender, &instance, &sequence);
+        }));
+    }
+
+    for (std::thread& thread : frame_threads)
+        thread.join();
+
+    const double wall_ms = elapsed_ms(wall_begin, clock::now());
+
+    std::printf("\n frame    total ms      pre ms  threads ms     post ms    fetch ms  checksum          mean rgb\n");
+
+    double total_min = 1e30, total_max = 0, total_sum = 0;
+    for (const render_report& report : reports)
+    {
+        std::printf("%6g %11.2f %11.2f %11.2f %11.2f %11.2f  %016llx  %.5f %.5f %.5f%s\n",
+                    report.time, report.total_ms, report.pre_ms, report.threads_ms, report.post_ms, report.fetch_ms,
+                    report.checksum, report.mean[0], report.mean[1], report.mean[2],
+                    succeeded(report.status) ? "" : "  FAILED");
+
+        total_min = std::min(total_min, report.total_ms);
+        total_max = std::max(total_max, report.total_ms);
+        total_sum += report.total_ms;
+    }
+
+    std::printf("\nwall %.2f ms, %.2f frames/s, render min %.2f / mean %.2f / max %.2f ms\n",
+                wall_ms, opts.frames * 1000.0 / wall_ms, total_min, total_sum / opts.frames, total_max);
+
+    bool failed = false;
+
+    if (opts.await_calibration > 0)
+        failed |= !await_rerender(host, *instances[0], writes, reports[0], opts.await_calibration, sources[0]->width, sources[0]->height, opts.window);
+
+    if (!opts.compare.empty())
+        failed |= !compare_render(host, descriptor, sources, opts, reports[0]);
+
+    const frame& last = *reports.back().output;
+
+    if (!opts.output.empty() && !io::write_image(opts.output, last.pixels.data(), last.width, last.height, 4, true))
+        std::fprintf(stderr, "[host] cannot write %s\n", opts.output.c_str());
+
+    for (std::unique_ptr<image_effect>& instance : instances)
+        host.action(kOfxActionDestroyInstance, instance.get());
+
+    host.action(kOfxActionUnload, nullptr);
+
+    for (const render_report& report : reports)
+        failed |= !succeeded(report.status);
+
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,1084 @@
+//
+//  host.h
+//  MakeHDR
+//
+//  Created by Vahan Sosoyan 2024.
+//
+
+#ifndef host_h
+#define host_h
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+
+#include "ofxCore.h"
+#include "ofxProperty.h"
+#include "ofxImageEffect.h"
+#include "ofxParam.h"
+#include "ofxMemory.h"
+#include "ofxMultiThread.h"
+#include "ofxMessage.h"
+#include "ofxProgress.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+
+/// Minimal in-process OFX host: just enough of the property, image effect, parameter,
+/// memory, multithread, message and progress suites to load an image effect bundle,
+/// describe it in the general context, create instances and render float RGBA frames.
+/// Every suite call the plugin makes during a render is attributed to that render through
+/// a thread local, which is how the stage timings are measured from outside the plugin.
+namespace bench
+{
+    typedef std::chrono::steady_clock clock;
+
+    inline double elapsed_ms(const clock::time_point& begin, const clock::time_point& end)
+    {
+        return std::chrono::duration<double, std::milli>(end - begin).count();
+    }
+
+    /// One property, holding whichever value type the plugin or host last set.
+    struct property
+    {
+        std::vector<int> ints;
+        std::vector<double> doubles;
+        std::vector<std::string> strings;
+        std::vector<void*> pointers;
+
+        int dimension() const
+        {
+            return (int)std::max(std::max(ints.size(), doubles.size()), std::max(strings.size(), pointers.size()));
+        }
+    };
+
+    /// Property set with lenient reads: a missing property or index reads as zero, so
+    /// the plugin's optional host queries do not need to be enumerated here.
+    struct property_set
+    {
+    public:
+        virtual ~property_set() {}
+
+        void set_int(const std::string& name, const int index, const int value) { at(_values[name].ints, index) = value; }
+        void set_double(const std::string& name, const int index, const double value) { at(_values[name].doubles, index) = value; }
+        void set_string(const std::string& name, const int index, const std::string& value) { at(_values[name].strings, index) = value; }
+        void set_pointer(const std::string& name, const int index, void* value) { at(_values[name].pointers, index) = value; }
+
+        void set_ints(const std::string& name, const std::vector<int>& values) { _values[name].ints = values; }
+        void set_doubles(const std::string& name, const std::vector<double>& values) { _values[name].doubles = values; }
+        void set_strings(const std::string& name, const std::vector<std::string>& values) { _values[name].strings = values; }
+
+        int get_int(const std::string& name, const int index = 0) const
+        {
+            const property* value = find(name);
+            if (value == nullptr) return 0;
+            if (index < (int)value->ints.size()) return value->ints[index];
+            if (index < (int)value->doubles.size()) return (int)value->doubles[index];
+            return 0;
+        }
+
+        double get_double(const std::string& name, const int index = 0) const
+        {
+            const property* value = find(name);
+            if (value == nullptr) return 0;
+            if (index < (int)value->doubles.size()) return value->doubles[index];
+            if (index < (int)value->ints.size()) return value->ints[index];
+            return 0;
+        }
+
+        const char* get_string(const std::string& name, const int index = 0) const
+        {
+            const property* value = find(name);
+            return value != nullptr && index < (int)value->strings.size() ? value->strings[index].c_str() : "";
+        }
+
+        void* get_pointer(const std::string& name, const int index = 0) const
+        {
+            const property* value = find(name);
+            return value != nullptr && index < (int)value->pointers.size() ? value->pointers[index] : nullptr;
+        }
+
+        int dimension(const std::string& name) const
+        {
+            const property* value = find(name);
+            return value != nullptr ? value->dimension() : 0;
+        }
+
+        void reset(const std::string& name) { _values.erase(name); }
+
+        OfxPropertySetHandle handle() { return (OfxPropertySetHandle)this; }
+        static property_set* from(OfxPropertySetHandle handle) { return (property_set*)handle; }
+
+    private:
+        template<typename type>
+        static type& at(std::vector<type>& values, const int index)
+        {
+            if (index >= (int)values.size())
+                values.resize(index + 1);
+
+            return values[index];
+        }
+
+        const property* find(const std::string& name) const
+        {
+            std::map<std::string, property>::const_iterator it = _values.find(name);
+            return it != _values.end() ? &it->second : nullptr;
+        }
+
+        std::map<std::string, property> _values;
+    };
+
+    /// Parameter with its current value, one animation-free value per dimension.
+    struct param
+    {
+    public:
+        param(const std::string& type, const std::string& name) : type(type), name(name)
+        {
+            props.set_string(kOfxParamPropType, 0, type);
+            props.set_string(kOfxPropName, 0, name);
+            props.set_string(kOfxPropLabel, 0, name);
+        }
+
+        /// Starts the instance value at the descriptor's default.
+        void reset_value()
+        {
+            const int count = std::max(1, props.dimension(kOfxParamPropDefault));
+            values.assign(count, 0.0);
+
+            for (int i = 0; i < count; ++i)
+                values[i] = props.get_double(kOfxParamPropDefault, i);
+
+            text = props.get_string(kOfxParamPropDefault);
+        }
+
+        bool is_string() const { return type == kOfxParamTypeString; }
+        bool is_integer() const
+        {
+            return type == kOfxParamTypeInteger || type == kOfxParamTypeBoolean || type == kOfxParamTypeChoice ||
+                   type == kOfxParamTypeInteger2D || type == kOfxParamTypeInteger3D;
+        }
+
+        int count() const
+        {
+            if (type == kOfxParamTypeRGBA) return 4;
+            if (type == kOfxParamTypeRGB || type == kOfxParamTypeDouble3D || type == kOfxParamTypeInteger3D) return 3;
+            if (type == kOfxParamTypeDouble2D || type == kOfxParamTypeInteger2D) return 2;
+            return 1;
+        }
+
+        std::string type;
+        std::string name;
+        property_set props;
+        std::vector<double> values;
+        std::string text;
+        std::mutex mutex;
+        std::atomic<unsigned int> writes{ 0 };
+    };
+
+    struct image_effect;
+
+    struct param_set
+    {
+    public:
+        param* define(const std::string& type, const std::string& name)
+        {
+            params.push_back(std::unique_ptr<param>(new param(type, name)));
+            by_name[name] = params.back().get();
+            return params.back().get();
+        }
+
+        param* find(const std::string& name)
+        {
+            std::map<std::string, param*>::iterator it = by_name.find(name);
+            return it != by_name.end() ? it->second : nullptr;
+        }
+
+        property_set props;
+        std::vector<std::unique_ptr<param>> params;
+        std::map<std::string, param*> by_name;
+    };
+
+    /// Float RGBA frame, rows bottom to top like OFX images.
+    struct frame
+    {
+        int width = 0;
+        int height = 0;
+        std::vector<float> pixels;
+    };
+
+    /// Image handed to the plugin, released by clipReleaseImage.
+    struct image : public property_set
+    {
+        std::shared_ptr<frame> pixels;
+    };
+
+    struct clip
+    {
+        std::string name;
+        property_set props;
+        image_effect* effect = nullptr;
+        std::shared_ptr<frame> source;
+    };
+
+    /// Stage timings of one render, filled in by the suites while it runs.
+    struct render_record
+    {
+        double time = 0;
+        std::shared_ptr<frame> output;
+        clock::time_point begin;
+        clock::time_point end;
+        clock::time_point first_thread;
+        clock::time_point last_thread;
+        double threads_ms = 0;
+        double fetch_ms = 0;
+        int thread_calls = 0;
+    };
+
+    /// Descriptor or instance of an image effect.
+    struct image_effect
+    {
+    public:
+        clip* define_clip(const std::string& name)
+        {
+            clips.push_back(std::unique_ptr<clip>(new clip()));
+            clips.back()->name = name;
+            clips.back()->effect = this;
+            clips.back()->props.set_string(kOfxPropName, 0, name);
+            return clips.back().get();
+        }
+
+        clip* find_clip(const std::string& name)
+        {
+            for (std::unique_ptr<clip>& c : clips)
+                if (c->name == name) return c.get();
+
+            return nullptr;
+        }
+
+        OfxImageEffectHandle handle() { return (OfxImageEffectHandle)this; }
+        static image_effect* from(const void* handle) { return (image_effect*)handle; }
+
+        property_set props;
+        param_set params;
+        std::vector<std::unique_ptr<clip>> clips;
+        render_record* record = nullptr;
+    };
+
+    /// Render the calling thread is running, for attributing suite calls.
+    inline render_record*& current_record()
+    {
+        static thread_local render_record* record = nullptr;
+        return record;
+    }
+
+    struct thread_state
+    {
+        unsigned int index = 0;
+        bool spawned = false;
+    };
+
+    inline thread_state& current_thread()
+    {
+        static thread_local thread_state state;
+        return state;
+    }
+
+    /// Host side settings shared by every suite call.
+    struct settings
+    {
+        unsigned int threads = 1;
+        bool verbose = false;
+        std::string pixel_depth = kOfxBitDepthFloat;
+        std::string components = kOfxImageComponentRGBA;
+    };
+
+    inline settings& host_settings()
+    {
+        static settings s;
+        return s;
+    }
+
+    namespace property_suite
+    {
+        inline OfxStatus set_pointer(OfxPropertySetHandle h, const char* p, int i, void* v) { property_set::from(h)->set_pointer(p, i, v); return kOfxStatOK; }
+        inline OfxStatus set_string(OfxPropertySetHandle h, const char* p, int i, const char* v) { property_set::from(h)->set_string(p, i, v); return kOfxStatOK; }
+        inline OfxStatus set_double(OfxPropertySetHandle h, const char* p, int i, double v) { property_set::from(h)->set_double(p, i, v); return kOfxStatOK; }
+        inline OfxStatus set_int(OfxPropertySetHandle h, const char* p, int i, int v) { property_set::from(h)->set_int(p, i, v); return kOfxStatOK; }
+
+        inline OfxStatus set_pointer_n(OfxPropertySetHandle h, const char* p, int n, void* const* v)
+        {
+            for (int i = 0; i < n; ++i) property_set::from(h)->set_pointer(p, i, v[i]);
+            return kOfxStatOK;
+        }
+        inline OfxStatus set_string_n(OfxPropertySetHandle h, const char* p, int n, const char* const* v)
+        {
+            for (int i = 0; i < n; ++i) property_set::from(h)->set_string(p, i, v[i]);
+            return kOfxStatOK;
+        }
+        inline OfxStatus set_double_n(OfxPropertySetHandle h, const char* p, int n, const double* v)
+        {
+            for (int i = 0; i < n; ++i) property_set::from(h)->set_double(p, i, v[i]);
+            return kOfxStatOK;
+        }
+        inline OfxStatus set_int_n(OfxPropertySetHandle h, const char* p, int n, const int* v)
+        {
+            for (int i = 0; i < n; ++i) property_set::from(h)->set_int(p, i, v[i]);
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus get_pointer(OfxPropertySetHandle h, const char* p, int i, void** v) { *v = property_set::from(h)->get_pointer(p, i); return kOfxStatOK; }
+        inline OfxStatus get_string(OfxPropertySetHandle h, const char* p, int i, char** v) { *v = (char*)property_set::from(h)->get_string(p, i); return kOfxStatOK; }
+        inline OfxStatus get_double(OfxPropertySetHandle h, const char* p, int i, double* v) { *v = property_set::from(h)->get_double(p, i); return kOfxStatOK; }
+        inline OfxStatus get_int(OfxPropertySetHandle h, const char* p, int i, int* v) { *v = property_set::from(h)->get_int(p, i); return kOfxStatOK; }
+
+        inline OfxStatus get_pointer_n(OfxPropertySetHandle h, const char* p, int n, void** v)
+        {
+            for (int i = 0; i < n; ++i) v[i] = property_set::from(h)->get_pointer(p, i);
+            return kOfxStatOK;
+        }
+        inline OfxStatus get_string_n(OfxPropertySetHandle h, const char* p, int n, char** v)
+        {
+            for (int i = 0; i < n; ++i) v[i] = (char*)property_set::from(h)->get_string(p, i);
+            return kOfxStatOK;
+        }
+        inline OfxStatus get_double_n(OfxPropertySetHandle h, const char* p, int n, double* v)
+        {
+            for (int i = 0; i < n; ++i) v[i] = property_set::from(h)->get_double(p, i);
+            return kOfxStatOK;
+        }
+        inline OfxStatus get_int_n(OfxPropertySetHandle h, const char* p, int n, int* v)
+        {
+            for (int i = 0; i < n; ++i) v[i] = property_set::from(h)->get_int(p, i);
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus reset(OfxPropertySetHandle h, const char* p) { property_set::from(h)->reset(p); return kOfxStatOK; }
+        inline OfxStatus dimension(OfxPropertySetHandle h, const char* p, int* count) { *count = property_set::from(h)->dimension(p); return kOfxStatOK; }
+
+        inline const OfxPropertySuiteV1* get()
+        {
+            static OfxPropertySuiteV1 suite;
+            suite.propSetPointer = set_pointer;
+            suite.propSetString = set_string;
+            suite.propSetDouble = set_double;
+            suite.propSetInt = set_int;
+            suite.propSetPointerN = set_pointer_n;
+            suite.propSetStringN = set_string_n;
+            suite.propSetDoubleN = set_double_n;
+            suite.propSetIntN = set_int_n;
+            suite.propGetPointer = get_pointer;
+            suite.propGetString = get_string;
+            suite.propGetDouble = get_double;
+            suite.propGetInt = get_int;
+            suite.propGetPointerN = get_pointer_n;
+            suite.propGetStringN = get_string_n;
+            suite.propGetDoubleN = get_double_n;
+            suite.propGetIntN = get_int_n;
+            suite.propReset = reset;
+            suite.propGetDimension = dimension;
+            return &suite;
+        }
+    }
+
+    namespace effect_suite
+    {
+        inline OfxStatus get_property_set(OfxImageEffectHandle h, OfxPropertySetHandle* props)
+        {
+            *props = image_effect::from(h)->props.handle();
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus get_param_set(OfxImageEffectHandle h, OfxParamSetHandle* params)
+        {
+            *params = (OfxParamSetHandle)&image_effect::from(h)->params;
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus clip_define(OfxImageEffectHandle h, const char* name, OfxPropertySetHandle* props)
+        {
+            *props = image_effect::from(h)->define_clip(name)->props.handle();
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus clip_get_handle(OfxImageEffectHandle h, const char* name, OfxImageClipHandle* handle, OfxPropertySetHandle* props)
+        {
+            clip* c = image_effect::from(h)->find_clip(name);
+
+            if (c == nullptr)
+                return kOfxStatErrBadHandle;
+
+            *handle = (OfxImageClipHandle)c;
+
+            if (props != nullptr)
+                *props = c->props.handle();
+
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus clip_get_property_set(OfxImageClipHandle handle, OfxPropertySetHandle* props)
+        {
+            *props = ((clip*)handle)->props.handle();
+            return kOfxStatOK;
+        }
+
+        /// Sources hand out the decoded bracket, the output clip the frame of the render in flight.
+        inline OfxStatus clip_get_image(OfxImageClipHandle handle, OfxTime time, const OfxRectD* /*region*/, OfxPropertySetHandle* result)
+        {
+            const clock::time_point begin = clock::now();
+            clip* c = (clip*)handle;
+            render_record* record = current_record();
+
+            std::shared_ptr<frame> pixels = c->name == kOfxImageEffectOutputClipName
+                ? (record != nullptr ? record->output : nullptr)
+                : c->source;
+
+            if (pixels == nullptr)
+                return kOfxStatFailed;
+
+            image* img = new image();
+            img->pixels = pixels;
+
+            const int bounds[4] = { 0, 0, pixels->width, pixels->height };
+            img->set_pointer(kOfxImagePropData, 0, pixels->pixels.data());
+            img->set_ints(kOfxImagePropBounds, std::vector<int>(bounds, bounds + 4));
+            img->set_ints(kOfxImagePropRegionOfDefinition, std::vector<int>(bounds, bounds + 4));
+            img->set_int(kOfxImagePropRowBytes, 0, pixels->width * 4 * (int)sizeof(float));
+            img->set_string(kOfxImageEffectPropPixelDepth, 0, kOfxBitDepthFloat);
+            img->set_string(kOfxImageEffectPropComponents, 0, kOfxImageComponentRGBA);
+            img->set_string(kOfxImageEffectPropPreMultiplication, 0, kOfxImageOpaque);
+            img->set_string(kOfxImagePropField, 0, kOfxImageFieldNone);
+            img->set_string(kOfxImagePropUniqueIdentifier, 0, c->name + "@" + std::to_string(time));
+            img->set_double(kOfxImagePropPixelAspectRatio, 0, 1.0);
+            img->set_doubles(kOfxImageEffectPropRenderScale, { 1.0, 1.0 });
+
+            *result = img->handle();
+
+            if (record != nullptr)
+                record->fetch_ms += elapsed_ms(begin, clock::now());
+
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus clip_release_image(OfxPropertySetHandle handle)
+        {
+            delete (image*)property_set::from(handle);
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus clip_get_rod(OfxImageClipHandle handle, OfxTime /*time*/, OfxRectD* bounds)
+        {
+            clip* c = (clip*)handle;
+            std::shared_ptr<frame> pixels = c->source;
+
+            if (pixels == nullptr && !c->effect->clips.empty())
+                pixels = c->effect->find_clip("src1") != nullptr ? c->effect->find_clip("src1")->source : nullptr;
+
+            bounds->x1 = 0;
+            bounds->y1 = 0;
+            bounds->x2 = pixels != nullptr ? pixels->width : 0;
+            bounds->y2 = pixels != nullptr ? pixels->height : 0;
+            return kOfxStatOK;
+        }
+
+        inline int abort(OfxImageEffectHandle) { return 0; }
+
+        inline OfxStatus memory_alloc(OfxImageEffectHandle, size_t bytes, OfxImageMemoryHandle* handle)
+        {
+            *handle = (OfxImageMemoryHandle)new std::vector<unsigned char>(bytes);
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus memory_free(OfxImageMemoryHandle handle)
+        {
+            delete (std::vector<unsigned char>*)handle;
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus memory_lock(OfxImageMemoryHandle handle, void** data)
+        {
+            *data = ((std::vector<unsigned char>*)handle)->data();
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus memory_unlock(OfxImageMemoryHandle) { return kOfxStatOK; }
+
+        inline const OfxImageEffectSuiteV1* get()
+        {
+            static OfxImageEffectSuiteV1 suite;
+            suite.getPropertySet = get_property_set;
+            suite.getParamSet = get_param_set;
+            suite.clipDefine = clip_define;
+            suite.clipGetHandle = clip_get_handle;
+            suite.clipGetPropertySet = clip_get_property_set;
+            suite.clipGetImage = clip_get_image;
+            suite.clipReleaseImage = clip_release_image;
+            suite.clipGetRegionOfDefinition = clip_get_rod;
+            suite.abort = abort;
+            suite.imageMemoryAlloc = memory_alloc;
+            suite.imageMemoryFree = memory_free;
+            suite.imageMemoryLock = memory_lock;
+            suite.imageMemoryUnlock = memory_unlock;
+            return &suite;
+        }
+    }
+
+    namespace param_suite
+    {
+        inline OfxStatus define(OfxParamSetHandle h, const char* type, const char* name, OfxPropertySetHandle* props)
+        {
+            param* p = ((param_set*)h)->define(type, name);
+
+            if (props != nullptr)
+                *props = p->props.handle();
+
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus get_handle(OfxParamSetHandle h, const char* name, OfxParamHandle* handle, OfxPropertySetHandle* props)
+        {
+            param* p = ((param_set*)h)->find(name);
+
+            if (p == nullptr)
+                return kOfxStatErrUnknown;
+
+            *handle = (OfxParamHandle)p;
+
+            if (props != nullptr)
+                *props = p->props.handle();
+
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus set_get_property_set(OfxParamSetHandle h, OfxPropertySetHandle* props)
+        {
+            *props = ((param_set*)h)->props.handle();
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus get_property_set(OfxParamHandle h, OfxPropertySetHandle* props)
+        {
+            *props = ((param*)h)->props.handle();
+            return kOfxStatOK;
+        }
+
+        /// Writes the value through the typed out pointers of a variadic get.
+        inline OfxStatus read(param* p, va_list args)
+        {
+            std::lock_guard<std::mutex> lock(p->mutex);
+
+            if (p->is_string())
+            {
+                *va_arg(args, char**) = (char*)p->text.c_str();
+                return kOfxStatOK;
+            }
+
+            for (int i = 0; i < p->count(); ++i)
+            {
+                const double value = i < (int)p->values.size() ? p->values[i] : 0.0;
+
+                if (p->is_integer())
+                    *va_arg(args, int*) = (int)value;
+                else
+                    *va_arg(args, double*) = value;
+            }
+
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus write(param* p, va_list args)
+        {
+            std::lock_guard<std::mutex> lock(p->mutex);
+            ++p->writes;
+
+            if (p->is_string())
+            {
+                p->text = va_arg(args, const char*);
+                return kOfxStatOK;
+            }
+
+            p->values.resize(p->count());
+
+            for (int i = 0; i < p->count(); ++i)
+                p->values[i] = p->is_integer() ? (double)va_arg(args, int) : va_arg(args, double);
+
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus get_value(OfxParamHandle h, ...)
+        {
+            va_list args;
+            va_start(args, h);
+            const OfxStatus status = read((param*)h, args);
+            va_end(args);
+            return status;
+        }
+
+        inline OfxStatus get_value_at_time(OfxParamHandle h, OfxTime time, ...)
+        {
+            va_list args;
+            va_start(args, time);
+            const OfxStatus status = read((param*)h, args);
+            va_end(args);
+            return status;
+        }
+
+        inline OfxStatus get_derivative(OfxParamHandle h, OfxTime time, ...)
+        {
+            va_list args;
+            va_start(args, time);
+
+            for (int i = 0; i < ((param*)h)->count(); ++i)
+                *va_arg(args, double*) = 0.0;
+
+            va_end(args);
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus get_integral(OfxParamHandle h, OfxTime time1, OfxTime time2, ...)
+        {
+            param* p = (param*)h;
+            va_list args;
+            va_start(args, time2);
+
+            for (int i = 0; i < p->count(); ++i)
+                *va_arg(args, double*) = (i < (int)p->values.size() ? p->values[i] : 0.0) * (time2 - time1);
+
+            va_end(args);
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus set_value(OfxParamHandle h, ...)
+        {
+            va_list args;
+            va_start(args, h);
+            const OfxStatus status = write((param*)h, args);
+            va_end(args);
+            return status;
+        }
+
+        inline OfxStatus set_value_at_time(OfxParamHandle h, OfxTime time, ...)
+        {
+            va_list args;
+            va_start(args, time);
+            const OfxStatus status = write((param*)h, args);
+            va_end(args);
+            return status;
+        }
+
+        inline OfxStatus get_num_keys(OfxParamHandle, unsigned int* keys) { *keys = 0; return kOfxStatOK; }
+        inline OfxStatus get_key_time(OfxParamHandle, unsigned int, OfxTime*) { return kOfxStatErrBadIndex; }
+        inline OfxStatus get_key_index(OfxParamHandle, OfxTime, int, int*) { return kOfxStatFailed; }
+        inline OfxStatus delete_key(OfxParamHandle, OfxTime) { return kOfxStatOK; }
+        inline OfxStatus delete_all_keys(OfxParamHandle) { return kOfxStatOK; }
+        inline OfxStatus copy(OfxParamHandle, OfxParamHandle, OfxTime, const OfxRangeD*) { return kOfxStatErrUnsupported; }
+        inline OfxStatus edit_begin(OfxParamSetHandle, const char*) { return kOfxStatOK; }
+        inline OfxStatus edit_end(OfxParamSetHandle) { return kOfxStatOK; }
+
+        inline const OfxParameterSuiteV1* get()
+        {
+            static OfxParameterSuiteV1 suite;
+            suite.paramDefine = define;
+            suite.paramGetHandle = get_handle;
+            suite.paramSetGetPropertySet = set_get_property_set;
+            suite.paramGetPropertySet = get_property_set;
+            suite.paramGetValue = get_value;
+            suite.paramGetValueAtTime = get_value_at_time;
+            suite.paramGetDerivative = get_derivative;
+            suite.paramGetIntegral = get_integral;
+            suite.paramSetValue = set_value;
+            suite.paramSetValueAtTime = set_value_at_time;
+            suite.paramGetNumKeys = get_num_keys;
+            suite.paramGetKeyTime = get_key_time;
+            suite.paramGetKeyIndex = get_key_index;
+            suite.paramDeleteKey = delete_key;
+            suite.paramDeleteAllKeys = delete_all_keys;
+            suite.paramCopy = copy;
+            suite.paramEditBegin = edit_begin;
+            suite.paramEditEnd = edit_end;
+            return &suite;
+        }
+    }
+
+    namespace memory_suite
+    {
+        inline OfxStatus alloc(void*, size_t bytes, void** data)
+        {
+            *data = std::malloc(bytes);
+            return *data != nullptr ? kOfxStatOK : kOfxStatErrMemory;
+        }
+
+        inline OfxStatus free(void* data)
+        {
+            std::free(data);
+            return kOfxStatOK;
+        }
+
+        inline const OfxMemorySuiteV1* get()
+        {
+            static OfxMemorySuiteV1 suite;
+            suite.memoryAlloc = alloc;
+            suite.memoryFree = free;
+            return &suite;
+        }
+    }
+
+    namespace thread_suite
+    {
+        /// Runs func on the host thread count, timing the call against the current render.
+        inline OfxStatus multi_thread(OfxThreadFunctionV1 func, unsigned int count, void* arg)
+        {
+            render_record* record = current_record();
+            const clock::time_point begin = clock::now();
+
+            if (count == 0)
+                count = host_settings().threads;
+
+            if (count <= 1)
+            {
+                func(0, 1, arg);
+            }
+            else
+            {
+                std::vector<std::thread> threads;
+
+                for (unsigned int i = 0; i < count; ++i)
+                {
+                    threads.push_back(std::thread([=]()
+                    {
+                        current_thread().index = i;
+                        current_thread().spawned = true;
+                        func(i, count, arg);
+                    }));
+                }
+
+                for (std::thread& thread : threads)
+                    thread.join();
+            }
+
+            if (record != nullptr)
+            {
+                const clock::time_point end = clock::now();
+
+                if (record->thread_calls++ == 0)
+                    record->first_thread = begin;
+
+                record->last_thread = end;
+                record->threads_ms += elapsed_ms(begin, end);
+            }
+
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus num_cpus(unsigned int* count) { *count = host_settings().threads; return kOfxStatOK; }
+        inline OfxStatus index(unsigned int* index) { *index = current_thread().index; return kOfxStatOK; }
+        inline int is_spawned() { return current_thread().spawned ? 1 : 0; }
+
+        inline OfxStatus mutex_create(OfxMutexHandle* mutex, int)
+        {
+            *mutex = (OfxMutexHandle)new std::recursive_mutex();
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus mutex_destroy(const OfxMutexHandle mutex) { delete (std::recursive_mutex*)mutex; return kOfxStatOK; }
+        inline OfxStatus mutex_lock(const OfxMutexHandle mutex) { ((std::recursive_mutex*)mutex)->lock(); return kOfxStatOK; }
+        inline OfxStatus mutex_unlock(const OfxMutexHandle mutex) { ((std::recursive_mutex*)mutex)->unlock(); return kOfxStatOK; }
+        inline OfxStatus mutex_try_lock(const OfxMutexHandle mutex) { return ((std::recursive_mutex*)mutex)->try_lock() ? kOfxStatOK : kOfxStatFailed; }
+
+        inline const OfxMultiThreadSuiteV1* get()
+        {
+            static OfxMultiThreadSuiteV1 suite;
+            suite.multiThread = multi_thread;
+            suite.multiThreadNumCPUs = num_cpus;
+            suite.multiThreadIndex = index;
+            suite.multiThreadIsSpawnedThread = is_spawned;
+            suite.mutexCreate = mutex_create;
+            suite.mutexDestroy = mutex_destroy;
+            suite.mutexLock = mutex_lock;
+            suite.mutexUnLock = mutex_unlock;
+            suite.mutexTryLock = mutex_try_lock;
+            return &suite;
+        }
+    }
+
+    namespace message_suite
+    {
+        inline OfxStatus print(const char* type, const char* format, va_list args)
+        {
+            std::fprintf(stderr, "[plugin %s] ", type);
+            std::vfprintf(stderr, format, args);
+            std::fprintf(stderr, "\n");
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus message(void*, const char* type, const char*, const char* format, ...)
+        {
+            va_list args;
+            va_start(args, format);
+            const OfxStatus status = print(type, format, args);
+            va_end(args);
+            return status;
+        }
+
+        inline OfxStatus set_persistent(void*, const char* type, const char*, const char* format, ...)
+        {
+            va_list args;
+            va_start(args, format);
+            const OfxStatus status = print(type, format, args);
+            va_end(args);
+            return status;
+        }
+
+        inline OfxStatus clear_persistent(void*) { return kOfxStatOK; }
+
+        inline const OfxMessageSuiteV1* get_v1()
+        {
+            static OfxMessageSuiteV1 suite;
+            suite.message = message;
+            return &suite;
+        }
+
+        inline const OfxMessageSuiteV2* get_v2()
+        {
+            static OfxMessageSuiteV2 suite;
+            suite.message = message;
+            suite.setPersistentMessage = set_persistent;
+            suite.clearPersistentMessage = clear_persistent;
+            return &suite;
+        }
+    }
+
+    namespace progress_suite
+    {
+        inline OfxStatus start(void*, const char* label)
+        {
+            if (host_settings().verbose)
+                std::fprintf(stderr, "[progress] %s\n", label);
+
+            return kOfxStatOK;
+        }
+
+        inline OfxStatus update(void*, double) { return kOfxStatOK; }
+        inline OfxStatus end(void*) { return kOfxStatOK; }
+
+        inline const OfxProgressSuiteV1* get()
+        {
+            static OfxProgressSuiteV1 suite;
+            suite.progressStart = start;
+            suite.progressUpdate = update;
+            suite.progressEnd = end;
+            return &suite;
+        }
+    }
+
+    inline const void* fetch_suite(OfxPropertySetHandle, const char* name, int version)
+    {
+        const std::string suite(name);
+
+        if (suite == kOfxPropertySuite && version == 1) return property_suite::get();
+        if (suite == kOfxImageEffectSuite && version == 1) return effect_suite::get();
+        if (suite == kOfxParameterSuite && version == 1) return param_suite::get();
+        if (suite == kOfxMemorySuite && version == 1) return memory_suite::get();
+        if (suite == kOfxMultiThreadSuite && version == 1) return thread_suite::get();
+        if (suite == kOfxMessageSuite && version == 1) return message_suite::get_v1();
+        if (suite == kOfxMessageSuite && version == 2) return message_suite::get_v2();
+        if (suite == kOfxProgressSuite && version == 1) return progress_suite::get();
+
+        if (host_settings().verbose)
+            std::fprintf(stderr, "[host] suite %s v%d not provided\n", name, version);
+
+        return nullptr;
+    }
+
+    /// Loaded plugin binary and its image effect entry point.
+    class plugin
+    {
+    public:
+        ~plugin()
+        {
+#if defined(_WIN32)
+            if (_library != nullptr) FreeLibrary((HMODULE)_library);
+#else
+            if (_library != nullptr) dlclose(_library);
+#endif
+        }
+
+        /// Accepts the .ofx binary or the .ofx.bundle directory.
+        bool load(std::string path, const std::string& identifier)
+        {
+            if (path.size() > 7 && path.compare(path.size() - 7, 7, ".bundle") == 0)
+            {
+                const std::string name = path.substr(path.find_last_of("/\\") + 1);
+#if defined(_WIN32)
+                path += "/Contents/Win64/" + name.substr(0, name.size() - 7);
+#elif defined(__APPLE__)
+                path += "/Contents/MacOS/" + name.substr(0, name.size() - 7);
+#else
+                path += "/Contents/Linux-x86-64/" + name.substr(0, name.size() - 7);
+#endif
+            }
+
+#if defined(_WIN32)
+            _library = (void*)LoadLibraryA(path.c_str());
+            auto symbol = [&](const char* name) { return (void*)GetProcAddress((HMODULE)_library, name); };
+#else
+            _library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+            auto symbol = [&](const char* name) { return dlsym(_library, name); };
+#endif
+            if (_library == nullptr)
+            {
+                std::fprintf(stderr, "[host] cannot load %s\n", path.c_str());
+                return false;
+            }
+
+            typedef int (*count_function)(void);
+            typedef OfxPlugin* (*get_function)(int);
+
+            count_function count = (count_function)symbol("OfxGetNumberOfPlugins");
+            get_function get = (get_function)symbol("OfxGetPlugin");
+
+            if (count == nullptr || get == nullptr)
+            {
+                std::fprintf(stderr, "[host] %s is not an OFX plugin\n", path.c_str());
+                return false;
+            }
+
+            for (int i = 0; i < count(); ++i)
+            {
+                OfxPlugin* candidate = get(i);
+
+                if (std::string(candidate->pluginApi) == kOfxImageEffectPluginApi &&
+                    (identifier.empty() || identifier == candidate->pluginIdentifier))
+                {
+                    _plugin = candidate;
+                    break;
+                }
+            }
+
+            if (_plugin == nullptr)
+            {
+                std::fprintf(stderr, "[host] no image effect plugin found in %s\n", path.c_str());
+                return false;
+            }
+
+            _host_props.set_string(kOfxPropType, 0, kOfxTypeImageEffectHost);
+            _host_props.set_string(kOfxPropName, 0, "net.sf.openfx.make_hdr_bench");
+            _host_props.set_string(kOfxPropLabel, 0, "MakeHDR bench");
+            _host_props.set_ints(kOfxPropAPIVersion, { 1, 4 });
+            _host_props.set_ints(kOfxPropVersion, { 1, 0, 0 });
+            _host_props.set_string(kOfxPropVersionLabel, 0, "1.0");
+            _host_props.set_int(kOfxImageEffectHostPropIsBackground, 0, 1);
+            _host_props.set_int(kOfxImageEffectPropSupportsOverlays, 0, 0);
+            _host_props.set_int(kOfxImageEffectPropSupportsMultiResolution, 0, 1);
+            _host_props.set_int(kOfxImageEffectPropSupportsTiles, 0, 0);
+            _host_props.set_int(kOfxImageEffectPropTemporalClipAccess, 0, 0);
+            _host_props.set_int(kOfxImageEffectPropSupportsMultipleClipDepths, 0, 0);
+            _host_props.set_int(kOfxImageEffectPropSupportsMultipleClipPARs, 0, 0);
+            _host_props.set_int(kOfxImageEffectPropSetableFrameRate, 0, 0);
+            _host_props.set_int(kOfxImageEffectPropSetableFielding, 0, 0);
+            _host_props.set_int(kOfxParamHostPropSupportsStringAnimation, 0, 0);
+            _host_props.set_int(kOfxParamHostPropSupportsChoiceAnimation, 0, 0);
+            _host_props.set_int(kOfxParamHostPropSupportsBooleanAnimation, 0, 0);
+            _host_props.set_int(kOfxParamHostPropSupportsCustomAnimation, 0, 0);
+            _host_props.set_int(kOfxParamHostPropSupportsCustomInteract, 0, 0);
+            _host_props.set_int(kOfxParamHostPropMaxParameters, 0, -1);
+            _host_props.set_int(kOfxParamHostPropMaxPages, 0, 0);
+            _host_props.set_ints(kOfxParamHostPropPageRowColumnCount, { 0, 0 });
+            _host_props.set_strings(kOfxImageEffectPropSupportedComponents, { kOfxImageComponentRGBA });
+            _host_props.set_strings(kOfxImageEffectPropSupportedContexts, { kOfxImageEffectContextGeneral, kOfxImageEffectContextFilter });
+            _host_props.set_strings(kOfxImageEffectPropSupportedPixelDepths, { kOfxBitDepthFloat });
+            _host_props.set_string(kOfxImageEffectHostPropNativeOrigin, 0, kOfxHostNativeOriginBottomLeft);
+
+            _host.host = _host_props.handle();
+            _host.fetchSuite = fetch_suite;
+            _plugin->setHost(&_host);
+
+            return true;
+        }
+
+        OfxStatus action(const char* name, image_effect* effect, property_set* in_args = nullptr, property_set* out_args = nullptr)
+        {
+            return _plugin->mainEntry(name,
+                                      effect != nullptr ? (const void*)effect->handle() : nullptr,
+                                      in_args != nullptr ? in_args->handle() : nullptr,
+                                      out_args != nullptr ? out_args->handle() : nullptr);
+        }
+
+        const OfxPlugin* get() const { return _plugin; }
+
+    private:
+        void* _library = nullptr;
+        OfxPlugin* _plugin = nullptr;
+        OfxHost _host;
+        property_set _host_props;
+    };
+
+    /// Creates an instance of a described effect, copying the clip and parameter definitions
+    /// and starting every parameter at its default.
+    inline std::unique_ptr<image_effect> instantiate(image_effect& descriptor)
+    {
+        std::unique_ptr<image_effect> instance(new image_effect());
+        instance->props.set_string(kOfxPropType, 0, kOfxTypeImageEffectInstance);
+        instance->props.set_string(kOfxImageEffectPropContext, 0, kOfxImageEffectContextGeneral);
+        instance->props.set_int(kOfxPropIsInteractive, 0, 0);
+        instance->props.set_double(kOfxImageEffectPropFrameRate, 0, 24.0);
+        instance->props.set_double(kOfxImageEffectPropProjectPixelAspectRatio, 0, 1.0);
+        instance->props.set_double(kOfxImageEffectInstancePropEffectDuration, 0, 1.0);
+        instance->props.set_int(kOfxImageEffectInstancePropSequentialRender, 0, 0);
+
+        for (std::unique_ptr<clip>& source : descriptor.clips)
+        {
+            clip* c = instance->define_clip(source->name);
+            c->props.set_string(kOfxPropType, 0, kOfxTypeClip);
+            c->props.set_int(kOfxImageClipPropConnected, 0, 0);
+            c->props.set_int(kOfxImageClipPropOptional, 0, source->props.get_int(kOfxImageClipPropOptional));
+            c->props.set_string(kOfxImageEffectPropPixelDepth, 0, host_settings().pixel_depth);
+            c->props.set_string(kOfxImageEffectPropComponents, 0, host_settings().components);
+            c->props.set_string(kOfxImageClipPropUnmappedPixelDepth, 0, host_settings().pixel_depth);
+            c->props.set_string(kOfxImageClipPropUnmappedComponents, 0, host_settings().components);
+            c->props.set_string(kOfxImageEffectPropPreMultiplication, 0, kOfxImageOpaque);
+            c->props.set_string(kOfxImageClipPropFieldOrder, 0, kOfxImageFieldNone);
+            c->props.set_double(kOfxImagePropPixelAspectRatio, 0, 1.0);
+            c->props.set_double(kOfxImageEffectPropFrameRate, 0, 24.0);
+            c->props.set_doubles(kOfxImageEffectPropFrameRange, { 0.0, 0.0 });
+            c->props.set_doubles(kOfxImageEffectPropUnmappedFrameRange, { 0.0, 0.0 });
+        }
+
+        instance->find_clip(kOfxImageEffectOutputClipName)->props.set_int(kOfxImageClipPropConnected, 0, 1);
+
+        for (std::unique_ptr<param>& source : descriptor.params.params)
+        {
+            param* p = instance->params.define(source->type, source->name);
+
+            for (const char* key : { kOfxPropLabel, kOfxParamPropHint, kOfxParamPropParent })
+                p->props.set_string(key, 0, source->props.get_string(key));
+
+            for (int i = 0; i < source->props.dimension(kOfxParamPropDefault); ++i)
+            {
+                if (source->is_string())
+                    p->props.set_string(kOfxParamPropDefault, i, source->props.get_string(kOfxParamPropDefault, i));
+                else
+                    p->props.set_double(kOfxParamPropDefault, i, source->props.get_double(kOfxParamPropDefault, i));
+            }
+
+            p->reset_value();
+        }
+
+        return instance;
+    }
+}
+
+#endif
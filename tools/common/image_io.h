@@ -0,0 +1,247 @@
+//
+//  image_io.h
+//  MakeHDR
+//
+//  Created by Vahan Sosoyan 2024.
+//
+
+#ifndef image_io_h
+#define image_io_h
+
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <csetjmp>
+
+#include <jpeglib.h>
+
+
+/// Image file helpers shared by the command line tools. Pixels are interleaved floats
+/// with 3 or 4 channels; bottom_up selects OFX row order instead of file row order.
+namespace io
+{
+    /// libjpeg exits the process on fatal errors by default, this returns to the caller instead.
+    struct jpeg_error : jpeg_error_mgr
+    {
+        jmp_buf jump;
+    };
+
+    inline void jpeg_fail(j_common_ptr info)
+    {
+        (*info->err->output_message)(info);
+        std::longjmp(((jpeg_error*)info->err)->jump, 1);
+    }
+
+    inline bool jpeg_size(const std::string& path, int& width, int& height)
+    {
+        FILE* file = std::fopen(path.c_str(), "rb");
+
+        if (file == nullptr)
+            return false;
+
+        jpeg_decompress_struct info;
+        jpeg_error error;
+        info.err = jpeg_std_error(&error);
+        error.error_exit = jpeg_fail;
+
+        jpeg_create_decompress(&info);
+
+        if (setjmp(error.jump))
+        {
+            jpeg_destroy_decompress(&info);
+            std::fclose(file);
+            return false;
+        }
+
+        jpeg_stdio_src(&info, file);
+        jpeg_read_header(&info, TRUE);
+
+        width = (int)info.image_width;
+        height = (int)info.image_height;
+
+        jpeg_destroy_decompress(&info);
+        std::fclose(file);
+
+        return true;
+    }
+
+    /// Decodes a jpeg as 8 bit RGB, handing every scanline to row(y, rgb) in file order.
+    inline bool decode_jpeg(const std::string& path, const std::function<void(int, const unsigned char*)>& row)
+    {
+        FILE* file = std::fopen(path.c_str(), "rb");
+
+        if (file == nullptr)
+            return false;
+
+        std::vector<unsigned char> scanline;
+        jpeg_decompress_struct info;
+        jpeg_error error;
+        info.err = jpeg_std_error(&error);
+        error.error_exit = jpeg_fail;
+
+        jpeg_create_decompress(&info);
+
+        if (setjmp(error.jump))
+        {
+            jpeg_destroy_decompress(&info);
+            std::fclose(file);
+            return false;
+        }
+
+        jpeg_stdio_src(&info, file);
+        jpeg_read_header(&info, TRUE);
+        info.out_color_space = JCS_RGB;
+        jpeg_start_decompress(&info);
+
+        scanline.resize((size_t)info.output_width * 3);
+
+        while (info.output_scanline < info.output_height)
+        {
+            unsigned char* line = scanline.data();
+            const int y = (int)info.output_scanline;
+            jpeg_read_scanlines(&info, &line, 1);
+            row(y, line);
+        }
+
+        jpeg_finish_decompress(&info);
+        jpeg_destroy_decompress(&info);
+        std::fclose(file);
+
+        return true;
+    }
+
+    /// Float value of every 8 bit code, linearised from sRGB unless srgb is off.
+    inline void code_values(const bool srgb, float lut[256])
+    {
+        for (int i = 0; i < 256; ++i)
+        {
+            const float value = i / 255.f;
+            lut[i] = !srgb ? value : value <= 0.04045f ? value / 12.92f : std::pow((value + 0.055f) / 1.055f, 2.4f);
+        }
+    }
+
+    /// Decodes a jpeg to floats with code_values. A fourth channel is set to 1.
+    inline bool read_jpeg(const std::string& path,
+                          const bool srgb,
+                          const int channels,
+                          const bool bottom_up,
+                          std::vector<float>& pixels,
+                          int& width,
+                          int& height)
+    {
+        if (!jpeg_size(path, width, height))
+            return false;
+
+        pixels.resize((size_t)width * height * channels);
+
+        float lut[256];
+        code_values(srgb, lut);
+
+        return decode_jpeg(path, [&](const int row, const unsigned char* rgb)
+        {
+            const int y = bottom_up ? height - 1 - row : row;
+            float* dst = pixels.data() + (size_t)y * width * channels;
+
+            for (int x = 0; x < width; ++x, dst += channels)
+            {
+                dst[0] = lut[rgb[x * 3 + 0]];
+                dst[1] = lut[rgb[x * 3 + 1]];
+                dst[2] = lut[rgb[x * 3 + 2]];
+
+                if (channels > 3)
+                    dst[3] = 1.f;
+            }
+        });
+    }
+
+    /// Portable float map, which stores rows bottom to top.
+    inline bool write_pfm(const std::string& path, const float* pixels, const int width, const int height, const int channels, const bool bottom_up)
+    {
+        FILE* file = std::fopen(path.c_str(), "wb");
+
+        if (file == nullptr)
+            return false;
+
+        std::fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+
+        std::vector<float> row((size_t)width * 3);
+
+        for (int i = 0; i < height; ++i)
+        {
+            const int y = bottom_up ? i : height - 1 - i;
+            const float* src = pixels + (size_t)y * width * channels;
+
+            for (int x = 0; x < width; ++x)
+                for (int c = 0; c < 3; ++c)
+                    row[x * 3 + c] = src[x * channels + c];
+
+            std::fwrite(row.data(), sizeof(float), row.size(), file);
+        }
+
+        std::fclose(file);
+        return true;
+    }
+
+    /// Radiance RGBE with flat scanlines, which stores rows top to bottom.
+    inline bool write_hdr(const std::string& path, const float* pixels, const int width, const int height, const int channels, const bool bottom_up)
+    {
+        FILE* file = std::fopen(path.c_str(), "wb");
+
+        if (file == nullptr)
+            return false;
+
+        std::fprintf(file, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n", height, width);
+
+        std::vector<unsigned char> row((size_t)width * 4);
+
+        for (int i = 0; i < height; ++i)
+        {
+            const int y = bottom_up ? height - 1 - i : i;
+            const float* src = pixels + (size_t)y * width * channels;
+
+            for (int x = 0; x < width; ++x)
+            {
+                const float r = std::max(0.f, src[x * channels + 0]);
+                const float g = std::max(0.f, src[x * channels + 1]);
+                const float b = std::max(0.f, src[x * channels + 2]);
+                const float v = std::max(r, std::max(g, b));
+                unsigned char* rgbe = &row[x * 4];
+
+                if (v < 1e-32f)
+                {
+                    rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+                    continue;
+                }
+
+                int exponent;
+                const float scale = std::frexp(v, &exponent) * 256.f / v;
+
+                rgbe[0] = (unsigned char)(r * scale);
+                rgbe[1] = (unsigned char)(g * scale);
+                rgbe[2] = (unsigned char)(b * scale);
+                rgbe[3] = (unsigned char)(exponent + 128);
+            }
+
+            std::fwrite(row.data(), 1, row.size(), file);
+        }
+
+        std::fclose(file);
+        return true;
+    }
+
+    /// Writes .hdr or .pfm depending on the extension.
+    inline bool write_image(const std::string& path, const float* pixels, const int width, const int height, const int channels, const bool bottom_up)
+    {
+        const std::string extension = path.size() > 4 ? path.substr(path.size() - 4) : "";
+
+        if (extension == ".pfm" || extension == ".PFM")
+            return write_pfm(path, pixels, width, height, channels, bottom_up);
+
+        return write_hdr(path, pixels, width, height, channels, bottom_up);
+    }
+}
+
+#endif